@@ -1,20 +1,263 @@
 #include "SymbolTable.h"
 
 // Constructor
+Symbol::Symbol() {
+    this->type = this->level = 0;
+    this->height = 1;
+    this->left = this->right = this->parent = nullptr;
+    this->next_in_level = nullptr;
+}
+
 Symbol::Symbol(string name, int level, int type, Symbol *parent = nullptr) {
     this->name = name;
     this->level = level;
     this->type = type;
+    this->height = 1;
     this->parent = parent;
     this->left = this->right = nullptr;
+    this->next_in_level = nullptr;
 }
 
-SymbolTable::SymbolTable() {
-    this->root = nullptr;
-    this->cur_level = 0;
+void *Symbol::operator new(size_t size) {
+    return SymbolStore::allocate(size);
+}
+
+void Symbol::operator delete(void *p) { SymbolStore::release(p); }
+
+// SymbolStore
+atomic<SymbolStore *> SymbolStore::active(nullptr);
+
+SymbolStore::SymbolStore(int fd, char *base) {
+    this->fd = fd;
+    this->base = base;
+    this->used = this->mapped = 0;
+    this->free_slots = nullptr;
+}
+
+// Maps the file once per process; false if that fails, which leaves the
+// nodes on the heap. The file is scratch space and is unlinked right away.
+bool SymbolStore::open(const string &path) {
+    static mutex opening;
+    lock_guard<mutex> guard(opening);
+    if (active.load())
+        return true;
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return false;
+    unlink(path.c_str());
+    void *base = mmap(nullptr, RESERVE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    active.store(new SymbolStore(fd, (char *)base));
+    return true;
+}
+
+// A freed slot if there is one, else the next one, growing the file first
+// when the slot would lie past its end
+void *SymbolStore::allocate(size_t size) {
+    SymbolStore *store = active.load();
+    if (store == nullptr)
+        return ::operator new(size);
+
+    lock_guard<mutex> guard(store->lock);
+    void *p = store->free_slots;
+    if (p) {
+        store->free_slots = *(void **)p;
+        return p;
+    }
+    if (store->used + size > store->mapped) {
+        if (store->mapped + GROW > RESERVE ||
+            ftruncate(store->fd, store->mapped + GROW) != 0)
+            throw bad_alloc();
+        store->mapped += GROW;
+    }
+    p = store->base + store->used;
+    store->used += size;
+    return p;
+}
+
+// Nodes allocated before the store was opened are still on the heap
+void SymbolStore::release(void *p) {
+    SymbolStore *store = active.load();
+    if (store == nullptr || p < store->base || p >= store->base + RESERVE) {
+        ::operator delete(p);
+        return;
+    }
+    lock_guard<mutex> guard(store->lock);
+    *(void **)p = store->free_slots;
+    store->free_slots = p;
+}
+
+Instruction::Instruction(Opcode op, string name, string value, int type,
+                         bool is_static) {
+    this->op = op;
+    this->name = name;
+    this->value = value;
+    this->type = type;
+    this->is_static = is_static;
+}
+
+// Rebuild the source line, used as the message of thrown errors
+string Instruction::str() const {
+    switch (this->op) {
+    case OP_INSERT:
+        return "INSERT " + name + " " + value + " " +
+               (is_static ? "true" : "false");
+    case OP_ASSIGN:
+        return "ASSIGN " + name + " " + value;
+    case OP_LOOKUP:
+        return "LOOKUP " + name;
+    case OP_BEGIN:
+        return "BEGIN";
+    case OP_END:
+        return "END";
+    case OP_REMOVE:
+        return "REMOVE " + name;
+    case OP_COMPLETE:
+        return name == "" ? "COMPLETE" : "COMPLETE " + name;
+    case OP_VISIBLE:
+        return "VISIBLE";
+    default:
+        return "PRINT";
+    }
+}
+
+Result::Result(Opcode op) {
+    this->op = op;
+    this->num_comp = this->num_splay = this->level = 0;
+}
+
+Options::Options() {
+    this->counters = true;
+    this->splay_mode = SPLAY_FULL;
+    this->splay_depth = 2;
+    this->splay_probability = 0.125;
+    this->rebalance_depth = 0;
+    this->filter_bits = 0;
+    this->cache_bits = 0;
+    this->lookahead = 0;
+    this->threads = 0;
+    this->speculate = 0;
+    this->memo = 0;
+    this->profile_in = this->profile_out = "";
+    this->compact = 0;
+    this->store = "";
+}
+
+// Command line options shared by main.cpp and server.cpp
+bool Options::set(const string &arg) {
+    if (arg == "--filter")
+        this->filter_bits = 20;
+    else if (arg.find("--filter=") == 0)
+        this->filter_bits = atoi(arg.c_str() + 9);
+    else if (arg == "--resolve-cache")
+        this->cache_bits = 10;
+    else if (arg.find("--resolve-cache=") == 0)
+        this->cache_bits = atoi(arg.c_str() + 16);
+    else if (arg.find("--lookahead=") == 0)
+        this->lookahead = atoi(arg.c_str() + 12);
+    else if (arg.find("--threads=") == 0)
+        this->threads = atoi(arg.c_str() + 10);
+    else if (arg.find("--speculate=") == 0)
+        this->speculate = atoi(arg.c_str() + 12);
+    else if (arg == "--memo")
+        this->memo = 4096;
+    else if (arg.find("--memo=") == 0)
+        this->memo = atoi(arg.c_str() + 7);
+    else if (arg == "--no-counters")
+        this->counters = false;
+    else if (arg == "--splay=full")
+        this->splay_mode = SPLAY_FULL;
+    else if (arg == "--splay=semi")
+        this->splay_mode = SPLAY_SEMI;
+    else if (arg.find("--splay=depth") == 0) {
+        this->splay_mode = SPLAY_DEPTH;
+        if (arg.size() > 13)
+            this->splay_depth = atof(arg.c_str() + 14);
+    } else if (arg.find("--splay=random") == 0) {
+        this->splay_mode = SPLAY_RANDOM;
+        if (arg.size() > 14)
+            this->splay_probability = atof(arg.c_str() + 15);
+    } else if (arg.find("--rebalance=") == 0)
+        this->rebalance_depth = atof(arg.c_str() + 12);
+    else if (arg.find("--profile-in=") == 0)
+        this->profile_in = arg.substr(13);
+    else if (arg.find("--profile-out=") == 0)
+        this->profile_out = arg.substr(14);
+    else if (arg.find("--compact=") == 0)
+        this->compact = atoi(arg.c_str() + 10);
+    else if (arg.find("--store=") == 0)
+        this->store = arg.substr(8);
+    else
+        return false;
+    return true;
+}
+
+// FNV-1a
+unsigned long long hashString(const string &s) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (unsigned int i = 0; i < s.size(); i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Sorts `threads` slices at once, then merges neighbouring slices until one
+// is left
+template <class T, class Less>
+void parallelSort(vector<T> &v, Less less, int threads) {
+    size_t n = v.size();
+    if (threads < 2 || n < 4096) {
+        sort(v.begin(), v.end(), less);
+        return;
+    }
+    vector<size_t> bounds;
+    for (int t = 0; t <= threads; t++)
+        bounds.push_back(n * t / threads);
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.push_back(thread([&, t]() {
+            sort(v.begin() + bounds[t], v.begin() + bounds[t + 1], less);
+        }));
+    for (int t = 0; t < threads; t++)
+        workers[t].join();
+
+    for (size_t width = 1; width < (size_t)threads; width *= 2) {
+        workers.clear();
+        for (size_t t = 0; t + width < (size_t)threads; t += 2 * width) {
+            size_t lo = bounds[t], mid = bounds[t + width],
+                   hi = bounds[min(t + 2 * width, (size_t)threads)];
+            workers.push_back(thread([&v, less, lo, mid, hi]() {
+                inplace_merge(v.begin() + lo, v.begin() + mid, v.begin() + hi,
+                              less);
+            }));
+        }
+        for (unsigned int k = 0; k < workers.size(); k++)
+            workers[k].join();
+    }
+}
+
+// Print a result the way run() reports it
+ostream &operator<<(ostream &out, const Result &r) {
+    if (countersOnly(r))
+        out << r.num_comp << " " << r.num_splay << endl;
+    else if (r.op == OP_LOOKUP)
+        out << r.level << endl;
+    else if ((r.op == OP_PRINT || r.op == OP_COMPLETE ||
+              r.op == OP_VISIBLE) &&
+             r.text != "")
+        out << r.text << endl;
+    return out;
 }
 
-SymbolTable::~SymbolTable() { clear(this->root); }
+bool countersOnly(const Result &r) {
+    return r.op == OP_INSERT || r.op == OP_ASSIGN || r.op == OP_REMOVE;
+}
 
 // Helper function
 int Symbol::compare(Symbol *x) {
@@ -29,32 +272,81 @@ int Symbol::compare(Symbol *x) {
     return 0;
 }
 
-void SymbolTable::clear(Symbol *root) {
-    if (root == nullptr)
-        return;
+int Symbol::compareByName(Symbol *x) {
+    int n_diff = this->name.compare(x->name);
+    if (n_diff != 0)
+        return n_diff > 0 ? 1 : -1;
+    if (this->level != x->level)
+        return this->level > x->level ? 1 : -1;
 
-    clear(root->left);
-    clear(root->right);
-    delete root;
+    return 0;
 }
 
-int SymbolTable::getType(string type) {
-    regex string("string");
-    regex number("number");
-    regex function(
-        "\\(((number|string)(,number|,string)*)?\\)->(number|string)");
+// SplayTree
+SplayTree::SplayTree() {
+    this->root = nullptr;
+    this->size = 0;
+    this->pool = nullptr;
+    this->pool_size = this->pool_live = 0;
+    this->mode = SPLAY_FULL;
+    this->depth_factor = 2;
+    this->probability = 0.125;
+    this->rebalance_depth = 0;
+    this->seed = 2463534242u;
+    this->rotations = this->rebalances = 0;
+    this->max_depth = 0;
+}
 
-    if (regex_match(type, number))
-        return 0;
-    if (regex_match(type, string))
-        return 1;
-    if (regex_match(type, function))
-        return 2;
+SplayTree::~SplayTree() { clear(this->root); }
 
-    return -1;
+// Access modes other than full splaying change the tree shape, so they only
+// apply when nobody relies on the counters
+void SplayTree::configure(const Options &opts) {
+    this->mode = opts.counters ? SPLAY_FULL : opts.splay_mode;
+    this->depth_factor = opts.splay_depth;
+    this->probability = opts.splay_probability;
+    this->rebalance_depth = opts.counters ? 0 : opts.rebalance_depth;
+}
+
+long long SplayTree::getRotations() const { return this->rotations; }
+
+long long SplayTree::getRebalances() const { return this->rebalances; }
+
+int SplayTree::getMaxDepth() const { return this->max_depth; }
+
+// Rotates left children up until the top has none, then frees the top, so
+// a degenerate tree millions of nodes deep does not overflow the stack
+void SplayTree::clear(Symbol *root) {
+    while (root != nullptr) {
+        Symbol *left = root->left;
+        if (left) {
+            root->left = left->right;
+            left->right = root;
+            root = left;
+        } else {
+            Symbol *right = root->right;
+            release(root);
+            root = right;
+        }
+    }
+}
+
+// Frees a node wherever it lives; the array of the last compaction goes
+// with its last node
+void SplayTree::release(Symbol *s) {
+    if (s < pool || s >= pool + pool_size) {
+        delete s;
+        return;
+    }
+    *s = Symbol();
+    if (--pool_live == 0) {
+        delete[] pool;
+        this->pool = nullptr;
+        this->pool_size = 0;
+    }
 }
 
-string SymbolTable::preorder(Symbol *root) {
+string SplayTree::preorder(Symbol *root) {
     if (root == nullptr)
         return "";
 
@@ -62,9 +354,10 @@ string SymbolTable::preorder(Symbol *root) {
            preorder(root->left) + preorder(root->right);
 }
 
-void SymbolTable::right_rotate(Symbol *x) {
+void SplayTree::right_rotate(Symbol *x) {
     if (x == nullptr || x->left == nullptr)
         return;
+    this->rotations++;
 
     Symbol *y = x->left;
     if (x->parent == nullptr)
@@ -82,9 +375,10 @@ void SymbolTable::right_rotate(Symbol *x) {
     x->parent = y;
 }
 
-void SymbolTable::left_rotate(Symbol *x) {
+void SplayTree::left_rotate(Symbol *x) {
     if (x == nullptr || x->right == nullptr)
         return;
+    this->rotations++;
 
     Symbol *y = x->right;
     x->right = y->left;
@@ -103,7 +397,7 @@ void SymbolTable::left_rotate(Symbol *x) {
     x->parent = y;
 }
 
-int SymbolTable::splay(Symbol *x) {
+int SplayTree::splay(Symbol *x) {
     if (x == nullptr || x->parent == nullptr)
         return 0;
 
@@ -136,30 +430,151 @@ int SymbolTable::splay(Symbol *x) {
     return 1;
 }
 
-bool SymbolTable::h_lookup(string name, int level) {
+// Semi-splaying: a zig-zig step only rotates the parent up and continues
+// from there, roughly halving the depth of the path instead of moving x
+// all the way to the root
+int SplayTree::semiSplay(Symbol *x) {
+    if (x == nullptr || x->parent == nullptr)
+        return 0;
+
+    while (x->parent != nullptr && x->parent->parent != nullptr) {
+        Symbol *p = x->parent;
+        Symbol *g = p->parent;
+        if (g->left == p && p->left == x) {
+            right_rotate(g);
+            x = p;
+        } else if (g->right == p && p->right == x) {
+            left_rotate(g);
+            x = p;
+        } else if (g->left == p) {
+            left_rotate(p);
+            right_rotate(g);
+        } else {
+            right_rotate(p);
+            left_rotate(g);
+        }
+    }
+
+    return 1;
+}
+
+// Record an access at `depth`; true when the guard wants the tree rebuilt
+bool SplayTree::degenerate(int depth) {
+    if (depth > this->max_depth)
+        this->max_depth = depth;
+    return this->rebalance_depth > 0 &&
+           depth > this->rebalance_depth * log2(this->size + 1.0);
+}
+
+// Day-Stout-Warren: unfold the tree into a right vine with right rotations,
+// then fold it back into a complete tree with runs of left rotations.
+// Linear time and no extra memory.
+void SplayTree::rebalance() {
+    Symbol pseudo("", 0, 0);
+    pseudo.right = this->root;
+
+    Symbol *tail = &pseudo;
+    Symbol *rest = tail->right;
+    int n = 0;
+    while (rest != nullptr) {
+        if (rest->left == nullptr) {
+            tail = rest;
+            rest = rest->right;
+            n++;
+        } else {
+            Symbol *t = rest->left;
+            rest->left = t->right;
+            t->right = rest;
+            rest = t;
+            tail->right = t;
+        }
+    }
+
+    int full = 1;
+    while (full * 2 <= n + 1)
+        full *= 2;
+    compress(&pseudo, n + 1 - full);
+    for (n = full - 1; n > 1; n /= 2)
+        compress(&pseudo, n / 2);
+
+    this->root = pseudo.right;
+    if (this->root) {
+        this->root->parent = nullptr;
+        relink(this->root);
+    }
+    this->rebalances++;
+}
+
+void SplayTree::compress(Symbol *top, int count) {
+    Symbol *scanner = top;
+    for (int i = 0; i < count; i++) {
+        Symbol *child = scanner->right;
+        scanner->right = child->right;
+        scanner = scanner->right;
+        child->right = scanner->left;
+        scanner->left = child;
+    }
+}
+
+void SplayTree::relink(Symbol *x) {
+    if (x->left) {
+        x->left->parent = x;
+        relink(x->left);
+    }
+    if (x->right) {
+        x->right->parent = x;
+        relink(x->right);
+    }
+}
+
+// Restructure after finding x at `depth` (the root is at depth 1)
+int SplayTree::access(Symbol *x, int depth) {
+    if (degenerate(depth)) {
+        rebalance();
+        return 0;
+    }
+    switch (this->mode) {
+    case SPLAY_SEMI:
+        return semiSplay(x);
+    case SPLAY_DEPTH:
+        if (depth > this->depth_factor * log2(this->size + 1.0))
+            return splay(x);
+        return 0;
+    case SPLAY_RANDOM:
+        this->seed ^= this->seed << 13;
+        this->seed ^= this->seed >> 17;
+        this->seed ^= this->seed << 5;
+        if (this->seed < this->probability * 4294967296.0)
+            return splay(x);
+        return 0;
+    default:
+        return splay(x);
+    }
+}
+
+Symbol *SplayTree::bst_search(string name, int level) {
     Symbol x(name, level, 0);
     Symbol *walker = this->root;
-    while (walker != nullptr) {
+    while (walker) {
         int order = x.compare(walker);
         if (order == 0) {
-            splay(walker);
-            return true;
+            return walker;
         } else if (order < 0) {
             if (walker->left == nullptr) {
-                return false;
+                return walker;
             }
             walker = walker->left;
         } else {
             if (walker->right == nullptr) {
-                return false;
+                return walker;
             }
             walker = walker->right;
         }
     }
-    return false;
+    return nullptr;
 }
 
-Symbol *SymbolTable::search_level(string name, int level, int &num_comp) {
+Symbol *SplayTree::search_level(string name, int level, int &num_comp) {
     Symbol x(name, level, 0);
     Symbol *walker = this->root;
     while (walker != nullptr) {
@@ -182,7 +597,7 @@ Symbol *SymbolTable::search_level(string name, int level, int &num_comp) {
     return nullptr;
 }
 
-Symbol *SymbolTable::getMaxValueNode(Symbol *root) {
+Symbol *SplayTree::getMaxValueNode(Symbol *root) {
     if (!root)
         return nullptr;
     Symbol *w = root;
@@ -192,100 +607,162 @@ Symbol *SymbolTable::getMaxValueNode(Symbol *root) {
     return w;
 }
 
-void SymbolTable::remove(Symbol *res) {
+// Splays res to the root, frees it and joins the two subtrees under the
+// maximum of the left one. A left subtree whose root has no right child is
+// topped by its maximum already, which spares the walk and the second
+// splay.
+void SplayTree::remove(Symbol *res) {
     if (this->root == nullptr)
         return;
     splay(res);
+    this->size--;
 
     Symbol *lh = this->root->left;
     Symbol *rh = this->root->right;
-
-    if (!lh && !rh) {
-        delete this->root;
-        this->root = nullptr;
-        return;
-    } else if (!lh) {
+    release(this->root);
+    if (lh)
+        lh->parent = nullptr;
+    if (rh)
         rh->parent = nullptr;
-        delete this->root;
-        this->root = rh;
+
+    if (!lh || !rh) {
+        this->root = lh ? lh : rh;
         return;
-    } else if (!rh) {
-        lh->parent = nullptr;
-        delete this->root;
-        this->root = lh;
-    } else {
-        lh->parent = nullptr;
-        delete this->root;
-        Symbol *x = getMaxValueNode(lh);
-        splay(x);
-        this->root = x;
-        x->right = rh;
-        rh->parent = x;
     }
+    this->root = lh;
+    if (lh->right)
+        splay(getMaxValueNode(lh));
+    this->root->right = rh;
+    rh->parent = this->root;
 }
 
-void SymbolTable::remove(int level) {
+template <class Visit> void SplayTree::remove(int level, Visit visit) {
     while (root) {
         Symbol *res = getMaxValueNode(root);
         if (res->level != level) {
             break;
         }
-        splay(res);
+        visit(res);
         remove(res);
     }
 }
 
-string SymbolTable::getParaType(string para, int &num_comp, int &num_splay) {
-    regex number("\\d+");
-    regex str("\'[A-Za-z0-9 ]*\'");
-    regex var("[a-z][\\w]*");
+void SplayTree::erase(Symbol *s) { remove(s); }
 
-    string res = "";
-    string sub = "";
-    for (unsigned int i = 0; i < para.length(); i++) {
-        // cout << sub << endl;
-        if (para[i] != ',') {
-            sub += para[i];
-        }
-        if (para[i] == ',' || i == para.length() - 1) {
-            if (regex_match(sub, number))
-                res += "number,";
-            else if (regex_match(sub, str))
-                res += "string,";
-            else if (regex_match(sub, var)) {
-                Symbol *x = search(sub, num_comp, num_splay);
-                if (!x)
-                    return "undeclared";
-                if (x->type == 0)
-                    res += "number,";
-                else if (x->type == 1)
-                    res += "string,";
-            } else
-                return "error";
+// Moves the nodes into a fresh array in preorder, so the top of the tree
+// shares a few cache lines and a left child sits next to its parent. Each
+// node is linked in under its moved parent as it arrives; the shape, and
+// so every counter, stays the same.
+void SplayTree::compact() {
+    if (this->root == nullptr)
+        return;
 
-            sub = "";
+    Symbol *fresh = new Symbol[this->size];
+    int n = 0;
+    vector<pair<Symbol *, Symbol *> > stack;
+    stack.push_back(make_pair(this->root, (Symbol *)nullptr));
+    while (!stack.empty()) {
+        Symbol *x = stack.back().first;
+        Symbol *parent = stack.back().second;
+        stack.pop_back();
+
+        Symbol *y = &fresh[n++];
+        *y = move(*x);
+        y->parent = parent;
+        if (parent == nullptr)
+            this->root = y;
+        else if (parent->left == x)
+            parent->left = y;
+        else
+            parent->right = y;
+        release(x);
+
+        if (y->right)
+            stack.push_back(make_pair(y->right, y));
+        if (y->left)
+            stack.push_back(make_pair(y->left, y));
+    }
+    this->pool = fresh;
+    this->pool_size = this->pool_live = n;
+}
+
+bool SplayTree::insert(Symbol *new_symbol, int &num_comp, int &num_splay) {
+    Symbol *walker = this->root;
+    Symbol *p = nullptr;
+    int depth = 1;
+
+    while (walker != nullptr) {
+        p = walker;
+        int order = new_symbol->compare(walker);
+        if (order < 0) {
+            walker = walker->left;
+            num_comp++;
+        } else if (order > 0) {
+            walker = walker->right;
+            num_comp++;
+        } else {
+            return false;
         }
+        depth++;
     }
-    if (res != " ")
-        return res.substr(0, res.size() - 1);
-    return "";
+
+    this->size++;
+    if (p == nullptr) {
+        this->root = new_symbol;
+        return true;
+    }
+
+    walker = new_symbol;
+    new_symbol->parent = p;
+
+    if (new_symbol->compare(p) < 0)
+        p->left = walker;
+    else
+        p->right = walker;
+
+    if (degenerate(depth)) {
+        rebalance();
+        return true;
+    }
+    if (walker != nullptr || walker->parent != nullptr) {
+        splay(walker);
+        num_splay++;
+    }
+
+    return true;
+}
+
+Symbol *SplayTree::search(string name, int level, int &num_comp,
+                          int &num_splay) {
+    Symbol *res = bst_search(name, level);
+    if (res && res->name.compare(name) == 0) {
+        int depth = 0;
+        res = search_level(name, level, depth);
+        num_comp += depth;
+        num_splay += access(res, depth);
+        return res;
+    }
+    return nullptr;
 }
 
-Symbol *SymbolTable::bst_search(string name, int level) {
+Symbol *SplayTree::lookup(string name, int level) {
     Symbol x(name, level, 0);
     Symbol *walker = this->root;
-    while (walker) {
+    int depth = 0;
+    while (walker != nullptr) {
+        depth++;
         int order = x.compare(walker);
         if (order == 0) {
+            access(walker, depth);
             return walker;
         } else if (order < 0) {
             if (walker->left == nullptr) {
-                return walker;
+                return nullptr;
             }
             walker = walker->left;
         } else {
             if (walker->right == nullptr) {
-                return walker;
+                return nullptr;
             }
             walker = walker->right;
         }
@@ -293,254 +770,2838 @@ Symbol *SymbolTable::bst_search(string name, int level) {
     return nullptr;
 }
 
-Symbol *SymbolTable::search(string name, int &num_comp, int &num_splay) {
-    if (this->root == nullptr)
-        return nullptr;
-    for (int level = this->cur_level; level >= 0; level--) {
-        Symbol *res = bst_search(name, level);
-        if (res->name.compare(name) == 0) {
-            res = search_level(name, level, num_comp);
-            num_splay += splay(res);
-            return res;
+Symbol *SplayTree::peek(string name, int level) const {
+    Symbol x(name, level, 0);
+    Symbol *walker = this->root;
+    while (walker != nullptr) {
+        int order = x.compare(walker);
+        if (order == 0)
+            return walker;
+        walker = order < 0 ? walker->left : walker->right;
+    }
+    return nullptr;
+}
+
+// Resolves (names[i], level) for the sorted names in a single descent
+// shared by all of them; nothing is splayed. The ranges left for the left
+// subtrees wait on a stack, since a splay tree can be a path millions of
+// nodes long.
+void SplayTree::lookupAll(int level, const vector<string> &names,
+                          vector<Symbol *> &found) {
+    struct Range {
+        Symbol *node;
+        int lo, hi;
+    };
+    vector<Range> todo;
+    Range all = {this->root, 0, (int)names.size()};
+    todo.push_back(all);
+    while (!todo.empty()) {
+        Symbol *node = todo.back().node;
+        int lo = todo.back().lo, hi = todo.back().hi;
+        todo.pop_back();
+        while (node && lo < hi) {
+            if (node->level != level) {
+                node = node->level < level ? node->right : node->left;
+                continue;
+            }
+            int mid = lower_bound(names.begin() + lo, names.begin() + hi,
+                                  node->name) -
+                      names.begin();
+            if (lo < mid && node->left) {
+                Range left = {node->left, lo, mid};
+                todo.push_back(left);
+            }
+            if (mid < hi && names[mid] == node->name)
+                found[mid++] = node;
+            lo = mid;
+            node = node->right;
         }
     }
+}
 
-    return NULL;
+// Balanced subtree of sorted[lo, hi) hanging from `parent`
+Symbol *SplayTree::build(const vector<Symbol *> &sorted, size_t lo, size_t hi,
+                         Symbol *parent) {
+    if (lo >= hi)
+        return nullptr;
+    size_t mid = lo + (hi - lo) / 2;
+    Symbol *x = sorted[mid];
+    x->parent = parent;
+    x->left = build(sorted, lo, mid, x);
+    x->right = build(sorted, mid + 1, hi, x);
+    return x;
 }
 
-void SymbolTable::insert(smatch m) {
-    // Get data from smatch m
-    smatch m1;
-    string line = m.str(0);
-    string name = m.str(1);
-    string type_str = m.str(2);
-    string is_static = m.str(3);
+// Weight-balanced tree over sorted[lo, hi), prefix[i] being the weight of
+// sorted[0, i): the root is the symbol splitting the weight of the range in
+// half, Mehlhorn's rule, which keeps the expected depth within a constant
+// of the optimal one at O(n log n) cost instead of Knuth's O(n^2)
+Symbol *SplayTree::build(const vector<Symbol *> &sorted,
+                         const vector<double> &prefix, size_t lo, size_t hi,
+                         Symbol *parent) {
+    if (lo >= hi)
+        return nullptr;
+    double half = (prefix[lo] + prefix[hi]) / 2;
+    size_t mid = upper_bound(prefix.begin() + lo + 1, prefix.begin() + hi,
+                             half) -
+                 prefix.begin() - 1;
+    Symbol *x = sorted[mid];
+    x->parent = parent;
+    x->left = build(sorted, prefix, lo, mid, x);
+    x->right = build(sorted, prefix, mid + 1, hi, x);
+    return x;
+}
 
-    int level = is_static == "true" ? 0 : this->cur_level;
+void SplayTree::inorder(vector<Symbol *> &res) const {
+    res.reserve(res.size() + this->size);
+    vector<Symbol *> stack;
+    for (Symbol *x = this->root; x || !stack.empty(); x = x->right) {
+        for (; x; x = x->left)
+            stack.push_back(x);
+        x = stack.back();
+        stack.pop_back();
+        res.push_back(x);
+    }
+}
 
-    // Handle type
-    regex string("string");
-    regex number("number");
-    regex function(
-        "\\(((number|string)(,number|,string)*)?\\)->(number|string)");
+// Rebuilds the tree weight-balanced, weight(symbol) being how often the
+// symbol is expected to be accessed
+template <class Weight> void SplayTree::reshape(Weight weight) {
+    vector<Symbol *> all;
+    inorder(all);
+    vector<double> prefix(all.size() + 1, 0);
+    for (size_t i = 0; i < all.size(); i++)
+        prefix[i + 1] = prefix[i] + weight(all[i]);
+    this->root = build(all, prefix, 0, all.size(), nullptr);
+}
 
-    int type = -1;
-    if (regex_match(type_str, number))
-        type = 0;
-    if (regex_match(type_str, string))
-        type = 1;
-    if (regex_match(type_str, m1, function))
-        type = 2;
+// Mean depth of an access, the root being at depth 1
+template <class Weight> double SplayTree::expectedDepth(Weight weight) const {
+    double total = 0, sum = 0;
+    vector<pair<Symbol *, int> > stack;
+    if (this->root)
+        stack.push_back(make_pair(this->root, 1));
+    while (!stack.empty()) {
+        Symbol *x = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        total += weight(x);
+        sum += weight(x) * depth;
+        if (x->left)
+            stack.push_back(make_pair(x->left, depth + 1));
+        if (x->right)
+            stack.push_back(make_pair(x->right, depth + 1));
+    }
+    return total > 0 ? sum / total : 0;
+}
 
-    if (type == -1)
-        throw InvalidInstruction(line);
-    if (type == 2 && level != 0)
-        throw InvalidDeclaration(line);
+// Adds symbols sorted by (level, name), none of them in the tree yet. A
+// batch past the current maximum becomes a balanced subtree joined under
+// it once it is splayed to the root. Otherwise both sequences are merged
+// and rebuilt into one balanced tree, unless the batch is too small for
+// that to beat inserting its symbols one by one. Nothing is counted.
+void SplayTree::insertAll(const vector<Symbol *> &sorted) {
+    if (sorted.empty())
+        return;
+    Symbol *max = this->root ? getMaxValueNode(this->root) : nullptr;
+    if (max == nullptr || max->compare(sorted.front()) < 0) {
+        Symbol *sub = build(sorted, 0, sorted.size(), nullptr);
+        if (max) {
+            splay(max);
+            max->right = sub;
+            sub->parent = max;
+        } else
+            this->root = sub;
+        this->size += sorted.size();
+        return;
+    }
 
-    int num_splay = 0;
-    int num_comp = 0;
+    if (sorted.size() * log2(this->size + 2.0) < this->size) {
+        int num_comp = 0, num_splay = 0;
+        for (unsigned int i = 0; i < sorted.size(); i++)
+            insert(sorted[i], num_comp, num_splay);
+        return;
+    }
 
-    Symbol *new_symbol = new Symbol(name, level, type);
-    if (type == 2) {
-        new_symbol->para = m1.str(0);
+    vector<Symbol *> mine, all;
+    inorder(mine);
+    all.resize(mine.size() + sorted.size());
+    merge(mine.begin(), mine.end(), sorted.begin(), sorted.end(), all.begin(),
+          [](Symbol *a, Symbol *b) { return a->compare(b) < 0; });
+    this->root = build(all, 0, all.size(), nullptr);
+    this->size = all.size();
+}
+
+template <class Visit> void SplayTree::forEach(Visit visit) const {
+    vector<Symbol *> stack;
+    if (this->root)
+        stack.push_back(this->root);
+    while (!stack.empty()) {
+        Symbol *x = stack.back();
+        stack.pop_back();
+        visit(x);
+        if (x->left)
+            stack.push_back(x->left);
+        if (x->right)
+            stack.push_back(x->right);
+    }
+}
+
+// One step down the path of (name, level): the child of `at` (the root when
+// null) the search would visit next is prefetched and returned; at the end
+// of the path `at` itself is returned. The tree is not modified.
+Symbol *SplayTree::prefetch(Symbol *at, const string &name, int level) {
+    Symbol *next = this->root;
+    if (at) {
+        int order = level != at->level ? level - at->level
+                                       : name.compare(at->name);
+        next = order < 0 ? at->left : order > 0 ? at->right : nullptr;
     }
+    if (!next)
+        return at;
+    __builtin_prefetch(next);
+    __builtin_prefetch(&next->level);
+    return next;
+}
+
+string SplayTree::preorder() { return preorder(this->root); }
 
+// NameSplayTree
+bool NameSplayTree::insert(Symbol *new_symbol, int &num_comp, int &num_splay) {
     Symbol *walker = this->root;
     Symbol *p = nullptr;
+    int depth = 1;
 
     while (walker != nullptr) {
         p = walker;
-        int order = new_symbol->compare(walker);
-        if (order < 0) {
-            walker = walker->left;
-            num_comp++;
-        } else if (order > 0) {
-            walker = walker->right;
-            num_comp++;
-        } else {
-            delete new_symbol;
-            throw Redeclared(m.str(0));
-        }
+        int order = new_symbol->compareByName(walker);
+        if (order == 0)
+            return false;
+        num_comp++;
+        walker = order < 0 ? walker->left : walker->right;
+        depth++;
     }
 
+    int level = new_symbol->level;
+    if ((int)level_head.size() <= level)
+        level_head.resize(level + 1, nullptr);
+    new_symbol->next_in_level = level_head[level];
+    level_head[level] = new_symbol;
+
+    this->size++;
     if (p == nullptr) {
         this->root = new_symbol;
-        cout << num_comp << " " << num_splay << endl;
-        return;
+        return true;
     }
 
-    walker = new_symbol;
     new_symbol->parent = p;
-
-    if (new_symbol->compare(p) < 0)
-        p->left = walker;
+    if (new_symbol->compareByName(p) < 0)
+        p->left = new_symbol;
     else
-        p->right = walker;
+        p->right = new_symbol;
 
-    if (walker != nullptr || walker->parent != nullptr) {
-        splay(walker);
-        num_splay++;
+    if (degenerate(depth)) {
+        rebalance();
+        return true;
+    }
+    splay(new_symbol);
+    num_splay++;
+    return true;
+}
+
+Symbol *NameSplayTree::find(string name, int level, int &num_comp) {
+    Symbol x(name, level, 0);
+    Symbol *walker = this->root;
+    while (walker != nullptr) {
+        num_comp++;
+        int order = x.compareByName(walker);
+        if (order == 0)
+            return walker;
+        walker = order < 0 ? walker->left : walker->right;
+    }
+    return nullptr;
+}
+
+Symbol *NameSplayTree::search(string name, int level, int &num_comp,
+                              int &num_splay) {
+    int depth = 0;
+    Symbol *res = find(name, level, depth);
+    if (res) {
+        num_comp += depth;
+        num_splay += access(res, depth);
+    }
+    return res;
+}
+
+Symbol *NameSplayTree::lookup(string name, int level) {
+    int depth = 0;
+    Symbol *res = find(name, level, depth);
+    if (res)
+        access(res, depth);
+    return res;
+}
+
+Symbol *NameSplayTree::peek(string name, int level) {
+    int depth = 0;
+    return find(name, level, depth);
+}
+
+// Predecessor of (name, level): the innermost declaration of name visible
+// from `level`, if the predecessor carries that name at all
+Symbol *NameSplayTree::resolve(string name, int level, int &num_comp,
+                               int &num_splay) {
+    Symbol x(name, level, 0);
+    Symbol *walker = this->root;
+    Symbol *best = nullptr;
+    int depth = 0, best_depth = 0;
+    while (walker != nullptr) {
+        depth++;
+        int order = x.compareByName(walker);
+        if (order >= 0) {
+            best = walker;
+            best_depth = depth;
+            if (order == 0)
+                break;
+            walker = walker->right;
+        } else {
+            walker = walker->left;
+        }
+    }
+
+    if (best == nullptr || best->name != name)
+        return nullptr;
+    num_comp += depth;
+    num_splay += access(best, best_depth);
+    return best;
+}
+
+// The level list is singly linked, so unlinking walks it
+void NameSplayTree::erase(Symbol *s) {
+    Symbol **link = &level_head[s->level];
+    while (*link != s)
+        link = &(*link)->next_in_level;
+    *link = s->next_in_level;
+    SplayTree::remove(s);
+}
+
+template <class Visit> void NameSplayTree::remove(int level, Visit visit) {
+    if (level >= (int)level_head.size())
+        return;
+
+    Symbol *walker = level_head[level];
+    while (walker != nullptr) {
+        Symbol *next = walker->next_in_level;
+        visit(walker);
+        SplayTree::remove(walker);
+        walker = next;
+    }
+    level_head[level] = nullptr;
+}
+
+// AVLTree
+AVLTree::AVLTree() { this->root = nullptr; }
+
+AVLTree::~AVLTree() { clear(this->root); }
+
+void AVLTree::configure(const Options &) {}
+
+void AVLTree::clear(Symbol *root) {
+    if (root == nullptr)
+        return;
+
+    clear(root->left);
+    clear(root->right);
+    delete root;
+}
+
+string AVLTree::preorder(Symbol *root) {
+    if (root == nullptr)
+        return "";
+
+    return root->name + "//" + to_string(root->level) + " " +
+           preorder(root->left) + preorder(root->right);
+}
+
+int AVLTree::height(Symbol *x) { return x ? x->height : 0; }
+
+void AVLTree::update(Symbol *x) {
+    x->height = 1 + max(height(x->left), height(x->right));
+}
+
+Symbol *AVLTree::right_rotate(Symbol *x) {
+    Symbol *y = x->left;
+    x->left = y->right;
+    y->right = x;
+    update(x);
+    update(y);
+    return y;
+}
+
+Symbol *AVLTree::left_rotate(Symbol *x) {
+    Symbol *y = x->right;
+    x->right = y->left;
+    y->left = x;
+    update(x);
+    update(y);
+    return y;
+}
+
+Symbol *AVLTree::balance(Symbol *x) {
+    update(x);
+    int diff = height(x->left) - height(x->right);
+    if (diff > 1) {
+        if (height(x->left->left) < height(x->left->right))
+            x->left = left_rotate(x->left);
+        return right_rotate(x);
+    }
+    if (diff < -1) {
+        if (height(x->right->right) < height(x->right->left))
+            x->right = right_rotate(x->right);
+        return left_rotate(x);
+    }
+    return x;
+}
+
+Symbol *AVLTree::insert(Symbol *root, Symbol *s, int &num_comp, bool &dup) {
+    if (root == nullptr)
+        return s;
+
+    int order = s->compare(root);
+    if (order == 0) {
+        dup = true;
+        return root;
+    }
+    num_comp++;
+    if (order < 0)
+        root->left = insert(root->left, s, num_comp, dup);
+    else
+        root->right = insert(root->right, s, num_comp, dup);
+
+    return dup ? root : balance(root);
+}
+
+Symbol *AVLTree::removeMax(Symbol *root, Symbol *&max) {
+    if (root->right == nullptr) {
+        max = root;
+        return root->left;
+    }
+    root->right = removeMax(root->right, max);
+    return balance(root);
+}
+
+// Unlink s below root; its place is taken by the maximum of its left
+// subtree
+Symbol *AVLTree::erase(Symbol *root, Symbol *s) {
+    if (root == s) {
+        if (root->left == nullptr)
+            return root->right;
+        Symbol *max = nullptr;
+        Symbol *left = removeMax(root->left, max);
+        max->left = left;
+        max->right = root->right;
+        return balance(max);
+    }
+    if (s->compare(root) < 0)
+        root->left = erase(root->left, s);
+    else
+        root->right = erase(root->right, s);
+    return balance(root);
+}
+
+Symbol *AVLTree::find(string name, int level, int &num_comp) {
+    Symbol x(name, level, 0);
+    Symbol *walker = this->root;
+    while (walker != nullptr) {
+        num_comp++;
+        int order = x.compare(walker);
+        if (order == 0)
+            return walker;
+        walker = order < 0 ? walker->left : walker->right;
+    }
+    return nullptr;
+}
+
+bool AVLTree::insert(Symbol *new_symbol, int &num_comp, int &) {
+    bool dup = false;
+    this->root = insert(this->root, new_symbol, num_comp, dup);
+    return !dup;
+}
+
+Symbol *AVLTree::search(string name, int level, int &num_comp, int &) {
+    int comp = 0;
+    Symbol *res = find(name, level, comp);
+    if (res)
+        num_comp += comp;
+    return res;
+}
+
+Symbol *AVLTree::lookup(string name, int level) {
+    int comp = 0;
+    return find(name, level, comp);
+}
+
+Symbol *AVLTree::peek(string name, int level) { return lookup(name, level); }
+
+void AVLTree::erase(Symbol *s) {
+    this->root = erase(this->root, s);
+    delete s;
+}
+
+template <class Visit> void AVLTree::remove(int level, Visit visit) {
+    while (this->root) {
+        Symbol *res = this->root;
+        while (res->right)
+            res = res->right;
+        if (res->level != level)
+            break;
+        this->root = removeMax(this->root, res);
+        visit(res);
+        delete res;
+    }
+}
+
+string AVLTree::preorder() { return preorder(this->root); }
+
+template <class Visit> void AVLTree::forEach(Visit visit) const {
+    vector<Symbol *> stack;
+    if (this->root)
+        stack.push_back(this->root);
+    while (!stack.empty()) {
+        Symbol *x = stack.back();
+        stack.pop_back();
+        visit(x);
+        if (x->left)
+            stack.push_back(x->left);
+        if (x->right)
+            stack.push_back(x->right);
+    }
+}
+
+// HashIndex
+HashIndex::~HashIndex() {
+    for (unsigned int i = 0; i < levels.size(); i++)
+        for (unsigned int j = 0; j < levels[i].size(); j++)
+            delete levels[i][j];
+}
+
+void HashIndex::configure(const Options &) {}
+
+bool HashIndex::byName(Symbol *a, Symbol *b) { return a->name < b->name; }
+
+// Declaration stacks are kept in ascending level order
+Symbol *HashIndex::find(string name, int level, int &num_comp) {
+    unordered_map<string, vector<Symbol *> >::iterator it = names.find(name);
+    if (it == names.end())
+        return nullptr;
+
+    vector<Symbol *> &stack = it->second;
+    for (int i = stack.size() - 1; i >= 0; i--) {
+        num_comp++;
+        if (stack[i]->level == level)
+            return stack[i];
+        if (stack[i]->level < level)
+            break;
+    }
+    return nullptr;
+}
+
+bool HashIndex::insert(Symbol *new_symbol, int &num_comp, int &) {
+    vector<Symbol *> &stack = names[new_symbol->name];
+    int i = stack.size();
+    while (i > 0 && stack[i - 1]->level >= new_symbol->level) {
+        num_comp++;
+        if (stack[i - 1]->level == new_symbol->level)
+            return false;
+        i--;
+    }
+    stack.insert(stack.begin() + i, new_symbol);
+
+    if ((int)levels.size() <= new_symbol->level)
+        levels.resize(new_symbol->level + 1);
+    levels[new_symbol->level].push_back(new_symbol);
+    return true;
+}
+
+Symbol *HashIndex::search(string name, int level, int &num_comp, int &) {
+    int comp = 0;
+    Symbol *res = find(name, level, comp);
+    if (res)
+        num_comp += comp;
+    return res;
+}
+
+Symbol *HashIndex::lookup(string name, int level) {
+    int comp = 0;
+    return find(name, level, comp);
+}
+
+Symbol *HashIndex::peek(string name, int level) { return lookup(name, level); }
+
+// The order within a level does not matter, so the last symbol of the
+// level takes the place of s
+void HashIndex::erase(Symbol *s) {
+    vector<Symbol *> &stack = names[s->name];
+    int i = stack.size() - 1;
+    while (stack[i] != s)
+        i--;
+    stack.erase(stack.begin() + i);
+    if (stack.empty())
+        names.erase(s->name);
+
+    vector<Symbol *> &level = levels[s->level];
+    i = level.size() - 1;
+    while (level[i] != s)
+        i--;
+    level[i] = level.back();
+    level.pop_back();
+    delete s;
+}
+
+template <class Visit> void HashIndex::remove(int level, Visit visit) {
+    if (level >= (int)levels.size())
+        return;
+
+    for (unsigned int i = 0; i < levels[level].size(); i++) {
+        Symbol *res = levels[level][i];
+        vector<Symbol *> &stack = names[res->name];
+        stack.pop_back();
+        if (stack.empty())
+            names.erase(res->name);
+        visit(res);
+        delete res;
+    }
+    levels[level].clear();
+}
+
+string HashIndex::preorder() {
+    string res = "";
+    for (unsigned int i = 0; i < levels.size(); i++) {
+        vector<Symbol *> sorted = levels[i];
+        sort(sorted.begin(), sorted.end(), byName);
+        for (unsigned int j = 0; j < sorted.size(); j++)
+            res += sorted[j]->name + "//" + to_string(sorted[j]->level) + " ";
+    }
+    return res;
+}
+
+template <class Visit> void HashIndex::forEach(Visit visit) const {
+    for (unsigned int i = 0; i < levels.size(); i++)
+        for (unsigned int j = 0; j < levels[i].size(); j++)
+            visit(levels[i][j]);
+}
+
+// BPlusTree
+BPlusTree::Node::Node(bool leaf) {
+    this->leaf = leaf;
+    this->size = 0;
+    this->next = nullptr;
+}
+
+BPlusTree::BPlusTree() { this->root = nullptr; }
+
+BPlusTree::~BPlusTree() { clear(this->root); }
+
+void BPlusTree::configure(const Options &) {}
+
+// Leaves own their symbols, inner nodes their separator copies
+void BPlusTree::clear(Node *n) {
+    if (n == nullptr)
+        return;
+
+    for (int i = 0; i < n->size; i++)
+        delete n->key[i];
+    if (!n->leaf)
+        for (int i = 0; i <= n->size; i++)
+            clear(n->child[i]);
+    delete n;
+}
+
+// First eight bytes of the name, big-endian, so that integer order matches
+// string order on the prefix
+unsigned long long BPlusTree::pack(const string &name) {
+    unsigned long long res = 0;
+    for (int i = 0; i < 8; i++) {
+        res <<= 8;
+        if (i < (int)name.size())
+            res |= (unsigned char)name[i];
+    }
+    return res;
+}
+
+void BPlusTree::place(Node *n, int i, Symbol *s, unsigned long long prefix) {
+    n->key[i] = s;
+    n->level[i] = s->level;
+    n->prefix[i] = prefix;
+}
+
+void BPlusTree::copy(Node *dst, int di, Node *src, int si) {
+    dst->key[di] = src->key[si];
+    dst->level[di] = src->level[si];
+    dst->prefix[di] = src->prefix[si];
+}
+
+// Number of keys in n smaller than (level, name), or not greater when
+// `upper` is set
+int BPlusTree::rank(Node *n, int level, unsigned long long prefix,
+                    const string &name, bool upper) {
+    int res = 0;
+    for (int i = 0; i < n->size; i++)
+        res += (n->level[i] < level) |
+               ((n->level[i] == level) & (n->prefix[i] < prefix));
+
+    while (res < n->size && n->level[res] == level &&
+           n->prefix[res] == prefix) {
+        int order = n->key[res]->name.compare(name);
+        if (order > 0 || (order == 0 && !upper))
+            break;
+        res++;
+    }
+    return res;
+}
+
+// A leaf separator is a private copy of the first key on its right
+Symbol *BPlusTree::separator(Node *right) {
+    return new Symbol(right->key[0]->name, right->key[0]->level, 0);
+}
+
+// Insert below n; returns the new right sibling and its separator in `sep`
+// when n had to split
+BPlusTree::Node *BPlusTree::insert(Node *n, Symbol *s, int &num_comp,
+                                   bool &dup, Symbol *&sep) {
+    num_comp++;
+    unsigned long long prefix = pack(s->name);
+    if (n->leaf) {
+        int i = rank(n, s->level, prefix, s->name, false);
+        if (i < n->size && n->key[i]->compare(s) == 0) {
+            dup = true;
+            return nullptr;
+        }
+        for (int j = n->size; j > i; j--)
+            copy(n, j, n, j - 1);
+        place(n, i, s, prefix);
+        n->size++;
+    } else {
+        int i = rank(n, s->level, prefix, s->name, true);
+        Symbol *child_sep = nullptr;
+        Node *right = insert(n->child[i], s, num_comp, dup, child_sep);
+        if (right == nullptr)
+            return nullptr;
+        for (int j = n->size; j > i; j--) {
+            copy(n, j, n, j - 1);
+            n->child[j + 1] = n->child[j];
+        }
+        place(n, i, child_sep, pack(child_sep->name));
+        n->child[i + 1] = right;
+        n->size++;
+    }
+
+    if (n->size <= FANOUT)
+        return nullptr;
+
+    Node *right = new Node(n->leaf);
+    int half = n->size / 2;
+    if (n->leaf) {
+        for (int j = half; j < n->size; j++)
+            copy(right, j - half, n, j);
+        right->size = n->size - half;
+        right->next = n->next;
+        n->next = right;
+        sep = separator(right);
+    } else {
+        sep = n->key[half];
+        for (int j = half + 1; j < n->size; j++)
+            copy(right, j - half - 1, n, j);
+        for (int j = half + 1; j <= n->size; j++)
+            right->child[j - half - 1] = n->child[j];
+        right->size = n->size - half - 1;
+    }
+    n->size = half;
+    return right;
+}
+
+// Drop every key of `level` and above below n; true if n became empty and
+// was freed
+bool BPlusTree::truncate(Node *n, int level) {
+    int i = rank(n, level, 0, "", false);
+    for (int j = i; j < n->size; j++) {
+        delete n->key[j];
+        if (!n->leaf)
+            clear(n->child[j + 1]);
+    }
+    n->size = i;
+
+    if (!n->leaf && truncate(n->child[i], level)) {
+        if (i == 0) {
+            delete n;
+            return true;
+        }
+        delete n->key[i - 1];
+        n->size = i - 1;
+    }
+    if (n->leaf && n->size == 0) {
+        delete n;
+        return true;
+    }
+    return false;
+}
+
+Symbol *BPlusTree::find(string name, int level, int &num_comp) {
+    Node *n = this->root;
+    if (n == nullptr)
+        return nullptr;
+
+    unsigned long long prefix = pack(name);
+    while (!n->leaf) {
+        num_comp++;
+        n = n->child[rank(n, level, prefix, name, true)];
+    }
+    num_comp++;
+    int i = rank(n, level, prefix, name, false);
+    if (i < n->size && n->level[i] == level && n->key[i]->name == name)
+        return n->key[i];
+    return nullptr;
+}
+
+bool BPlusTree::insert(Symbol *new_symbol, int &num_comp, int &) {
+    if (this->root == nullptr)
+        this->root = new Node(true);
+
+    bool dup = false;
+    Symbol *sep = nullptr;
+    Node *right = insert(this->root, new_symbol, num_comp, dup, sep);
+    if (right) {
+        Node *top = new Node(false);
+        place(top, 0, sep, pack(sep->name));
+        top->child[0] = this->root;
+        top->child[1] = right;
+        top->size = 1;
+        this->root = top;
+    }
+    return !dup;
+}
+
+Symbol *BPlusTree::search(string name, int level, int &num_comp, int &) {
+    int comp = 0;
+    Symbol *res = find(name, level, comp);
+    if (res)
+        num_comp += comp;
+    return res;
+}
+
+Symbol *BPlusTree::lookup(string name, int level) {
+    int comp = 0;
+    return find(name, level, comp);
+}
+
+Symbol *BPlusTree::peek(string name, int level) { return lookup(name, level); }
+
+// Take s out of the leaves below n; true if n is left underfull
+bool BPlusTree::erase(Node *n, Symbol *s, unsigned long long prefix) {
+    if (n->leaf) {
+        int i = rank(n, s->level, prefix, s->name, false);
+        for (int j = i + 1; j < n->size; j++)
+            copy(n, j - 1, n, j);
+        n->size--;
+    } else {
+        int i = rank(n, s->level, prefix, s->name, true);
+        if (erase(n->child[i], s, prefix))
+            refill(n, i);
+    }
+    return n->size < FANOUT / 2;
+}
+
+// Child i of n is underfull: it borrows a key from a sibling that can spare
+// one, or else merges with a sibling and their separator leaves n
+void BPlusTree::refill(Node *n, int i) {
+    if (n->size == 0)
+        return; // a lone child, left to the parent of n
+    Node *c = n->child[i];
+    Node *left = i > 0 ? n->child[i - 1] : nullptr;
+    Node *right = i < n->size ? n->child[i + 1] : nullptr;
+
+    if (left && left->size > FANOUT / 2) {
+        for (int j = c->size; j > 0; j--)
+            copy(c, j, c, j - 1);
+        if (c->leaf) {
+            copy(c, 0, left, left->size - 1);
+            delete n->key[i - 1];
+            Symbol *sep = separator(c);
+            place(n, i - 1, sep, pack(sep->name));
+        } else {
+            for (int j = c->size + 1; j > 0; j--)
+                c->child[j] = c->child[j - 1];
+            copy(c, 0, n, i - 1);
+            c->child[0] = left->child[left->size];
+            copy(n, i - 1, left, left->size - 1);
+        }
+        left->size--;
+        c->size++;
+        return;
+    }
+    if (right && right->size > FANOUT / 2) {
+        if (c->leaf) {
+            copy(c, c->size, right, 0);
+        } else {
+            copy(c, c->size, n, i);
+            c->child[c->size + 1] = right->child[0];
+            copy(n, i, right, 0);
+            for (int j = 0; j < right->size; j++)
+                right->child[j] = right->child[j + 1];
+        }
+        for (int j = 1; j < right->size; j++)
+            copy(right, j - 1, right, j);
+        right->size--;
+        c->size++;
+        if (c->leaf) {
+            delete n->key[i];
+            Symbol *sep = separator(right);
+            place(n, i, sep, pack(sep->name));
+        }
+        return;
+    }
+
+    // Neither sibling is over half full, so the pair fits in one node
+    int j = left ? i - 1 : i;
+    Node *a = n->child[j], *b = n->child[j + 1];
+    if (a->leaf) {
+        delete n->key[j];
+        a->next = b->next;
+    } else {
+        copy(a, a->size, n, j);
+        a->size++;
+        for (int k = 0; k <= b->size; k++)
+            a->child[a->size + k] = b->child[k];
+    }
+    for (int k = 0; k < b->size; k++)
+        copy(a, a->size + k, b, k);
+    a->size += b->size;
+    delete b;
+    for (int k = j + 1; k < n->size; k++) {
+        copy(n, k - 1, n, k);
+        n->child[k] = n->child[k + 1];
+    }
+    n->size--;
+}
+
+void BPlusTree::erase(Symbol *s) {
+    erase(this->root, s, pack(s->name));
+    while (!this->root->leaf && this->root->size == 0) {
+        Node *top = this->root;
+        this->root = top->child[0];
+        delete top;
+    }
+    if (this->root->size == 0) {
+        delete this->root;
+        this->root = nullptr;
+    }
+    delete s;
+}
+
+template <class Visit> void BPlusTree::remove(int level, Visit visit) {
+    if (this->root == nullptr)
+        return;
+
+    Node *n = this->root;
+    while (!n->leaf)
+        n = n->child[rank(n, level, 0, "", false)];
+    for (int i = rank(n, level, 0, "", false); n; n = n->next, i = 0)
+        for (; i < n->size; i++)
+            visit(n->key[i]);
+
+    if (truncate(this->root, level)) {
+        this->root = nullptr;
+        return;
+    }
+
+    while (!this->root->leaf && this->root->size == 0) {
+        Node *top = this->root;
+        this->root = top->child[0];
+        delete top;
+    }
+    n = this->root;
+    while (!n->leaf)
+        n = n->child[n->size];
+    n->next = nullptr;
+}
+
+// Leaves in key order, the closest a B+-tree has to the splay preorder
+string BPlusTree::preorder() {
+    string res = "";
+    Node *n = this->root;
+    if (n == nullptr)
+        return res;
+
+    while (!n->leaf)
+        n = n->child[0];
+    for (; n; n = n->next)
+        for (int i = 0; i < n->size; i++)
+            res += n->key[i]->name + "//" + to_string(n->level[i]) + " ";
+    return res;
+}
+
+template <class Visit> void BPlusTree::forEach(Visit visit) const {
+    Node *n = this->root;
+    if (n == nullptr)
+        return;
+
+    while (!n->leaf)
+        n = n->child[0];
+    for (; n; n = n->next)
+        for (int i = 0; i < n->size; i++)
+            visit(n->key[i]);
+}
+
+// NameFilter
+NameFilter::NameFilter() {
+    this->mask = 0;
+    this->queries = this->rejected = this->false_positives = 0;
+}
+
+void NameFilter::resize(int bits) {
+    counts.assign(bits > 0 ? 1ULL << bits : 0, 0);
+    this->mask = counts.empty() ? 0 : counts.size() - 1;
+}
+
+bool NameFilter::enabled() const { return !counts.empty(); }
+
+// The probes are h1 + i * h2 over the two halves of one 64-bit hash
+void NameFilter::add(const string &name) {
+    unsigned long long h = hashString(name);
+    unsigned long long step = (h >> 32) | 1;
+    for (int i = 0; i < HASHES; i++, h += step)
+        if (counts[h & mask] < 255)
+            counts[h & mask]++;
+}
+
+void NameFilter::remove(const string &name) {
+    unsigned long long h = hashString(name);
+    unsigned long long step = (h >> 32) | 1;
+    for (int i = 0; i < HASHES; i++, h += step)
+        if (counts[h & mask] < 255)
+            counts[h & mask]--;
+}
+
+bool NameFilter::mayContain(const string &name) {
+    this->queries++;
+    unsigned long long h = hashString(name);
+    unsigned long long step = (h >> 32) | 1;
+    for (int i = 0; i < HASHES; i++, h += step)
+        if (counts[h & mask] == 0) {
+            this->rejected++;
+            return false;
+        }
+    return true;
+}
+
+// A name got past the filter but no declaration was found
+void NameFilter::missed() { this->false_positives++; }
+
+void NameFilter::printStats(ostream &out) const {
+    long long misses = this->rejected + this->false_positives;
+    out << "filter: " << this->queries << " queries, " << this->rejected
+        << " rejected (" << (queries ? 100.0 * rejected / queries : 0)
+        << "%), " << this->false_positives << " false positives ("
+        << (misses ? 100.0 * false_positives / misses : 0)
+        << "% of misses)" << endl;
+}
+
+// ResolveCache
+ResolveCache::ResolveCache() {
+    this->mask = 0;
+    this->hits = this->misses = 0;
+}
+
+void ResolveCache::resize(int bits) {
+    Entry empty = {nullptr, 0, 0};
+    slots.assign(bits > 0 ? 1ULL << bits : 0, empty);
+    this->mask = slots.empty() ? 0 : slots.size() - 1;
+}
+
+bool ResolveCache::enabled() const { return !slots.empty(); }
+
+Symbol *ResolveCache::get(const string &name) {
+    Entry &e = slots[hashString(name) & mask];
+    if (e.symbol && e.level < (int)epochs.size() &&
+        epochs[e.level] == e.epoch && e.symbol->name == name) {
+        this->hits++;
+        return e.symbol;
+    }
+    this->misses++;
+    return nullptr;
+}
+
+void ResolveCache::put(const string &name, Symbol *s) {
+    if ((int)epochs.size() <= s->level)
+        epochs.resize(s->level + 1, 0);
+    Entry &e = slots[hashString(name) & mask];
+    e.symbol = s;
+    e.level = s->level;
+    e.epoch = epochs[s->level];
+}
+
+void ResolveCache::forget(const string &name) {
+    slots[hashString(name) & mask].symbol = nullptr;
+}
+
+// Every symbol of `level` is gone
+void ResolveCache::expire(int level) {
+    if (level < (int)epochs.size())
+        epochs[level]++;
+}
+
+void ResolveCache::printStats(ostream &out) const {
+    long long total = this->hits + this->misses;
+    out << "cache: " << total << " lookups, " << this->hits << " hits ("
+        << (total ? 100.0 * hits / total : 0) << "%)" << endl;
+}
+
+// NameTrie
+NameTrie::~NameTrie() { clear(&root); }
+
+void NameTrie::clear(Node *x) {
+    for (unsigned int i = 0; i < x->children.size(); i++) {
+        clear(x->children[i]);
+        delete x->children[i];
+    }
+    x->children.clear();
+}
+
+NameTrie::Node *NameTrie::child(const Node *x, char c) {
+    for (unsigned int i = 0; i < x->children.size(); i++)
+        if (x->children[i]->label[0] == c)
+            return x->children[i];
+    return nullptr;
+}
+
+// A node left without declarations and with a single child takes over the
+// child's label, declarations and children
+void NameTrie::merge(Node *x) {
+    if (!x->decls.empty() || x->children.size() != 1)
+        return;
+    Node *only = x->children[0];
+    x->label += only->label;
+    x->decls.swap(only->decls);
+    x->children.swap(only->children);
+    delete only;
+}
+
+// Splits the edge where the name leaves it, if it does
+void NameTrie::insert(const string &name, int level, const string &type) {
+    Node *x = &root;
+    size_t i = 0;
+    while (i < name.size()) {
+        Node *next = child(x, name[i]);
+        if (next == nullptr) {
+            next = new Node();
+            next->label = name.substr(i);
+            vector<Node *>::iterator at = x->children.begin();
+            while (at != x->children.end() && (*at)->label[0] < name[i])
+                at++;
+            x->children.insert(at, next);
+            i = name.size();
+        } else {
+            size_t k = 0;
+            while (k < next->label.size() && i + k < name.size() &&
+                   next->label[k] == name[i + k])
+                k++;
+            if (k < next->label.size()) {
+                Node *top = new Node();
+                top->label = next->label.substr(0, k);
+                next->label.erase(0, k);
+                top->children.push_back(next);
+                for (unsigned int j = 0; j < x->children.size(); j++)
+                    if (x->children[j] == next)
+                        x->children[j] = top;
+                next = top;
+            }
+            i += k;
+        }
+        x = next;
+    }
+
+    Decl d = {level, type};
+    vector<Decl>::iterator at = x->decls.end();
+    while (at != x->decls.begin() && (at - 1)->level > level)
+        at--;
+    x->decls.insert(at, d);
+}
+
+void NameTrie::erase(const string &name, int level) {
+    vector<Node *> path(1, &root);
+    size_t i = 0;
+    while (i < name.size()) {
+        Node *next = child(path.back(), name[i]);
+        if (next == nullptr || name.compare(i, next->label.size(),
+                                            next->label) != 0)
+            return;
+        i += next->label.size();
+        path.push_back(next);
+    }
+
+    Node *x = path.back();
+    for (int k = x->decls.size() - 1; k >= 0; k--)
+        if (x->decls[k].level == level) {
+            x->decls.erase(x->decls.begin() + k);
+            break;
+        }
+    if (x == &root || !x->decls.empty())
+        return;
+    if (x->children.empty()) {
+        Node *parent = path[path.size() - 2];
+        parent->children.erase(find(parent->children.begin(),
+                                    parent->children.end(), x));
+        delete x;
+        if (parent != &root)
+            merge(parent);
+    } else
+        merge(x);
+}
+
+template <class Visit>
+void NameTrie::walk(const Node *x, string &name, Visit visit) {
+    if (!x->decls.empty())
+        visit(name, x->decls.back().level, x->decls.back().type);
+    for (unsigned int i = 0; i < x->children.size(); i++) {
+        size_t size = name.size();
+        name += x->children[i]->label;
+        walk(x->children[i], name, visit);
+        name.resize(size);
+    }
+}
+
+// Calls visit(name, level, type) for the innermost declaration of every
+// name starting with `prefix`, in name order; of every name for ""
+template <class Visit>
+void NameTrie::complete(const string &prefix, Visit visit) const {
+    const Node *x = &root;
+    string name;
+    size_t i = 0;
+    while (i < prefix.size()) {
+        x = child(x, prefix[i]);
+        if (x == nullptr)
+            return;
+        size_t k = 0;
+        while (k < x->label.size() && i + k < prefix.size() &&
+               x->label[k] == prefix[i + k])
+            k++;
+        if (k < x->label.size() && i + k < prefix.size())
+            return;
+        name += x->label;
+        i += k;
+    }
+    walk(x, name, visit);
+}
+
+// FrontEnd
+FrontEnd::FrontEnd(istream &in, Instruction (*parse)(string), int threads) {
+    this->text.assign(istreambuf_iterator<char>(in),
+                      istreambuf_iterator<char>());
+    this->parse = parse;
+    this->threads = threads;
+    this->stop = false;
+    this->next = 0;
+    split();
+
+    this->rings = new Ring[threads > 0 ? threads : 1];
+    for (int i = 0; i < threads; i++) {
+        rings[i].head = rings[i].tail = 0;
+        workers.push_back(thread(&FrontEnd::work, this, i));
+    }
+}
+
+FrontEnd::~FrontEnd() {
+    this->stop = true;
+    for (unsigned int i = 0; i < workers.size(); i++)
+        workers[i].join();
+    delete[] rings;
+}
+
+// Chunk ends are found with memchr, which libc vectorizes
+void FrontEnd::split() {
+    const char *s = text.data();
+    size_t size = text.size();
+    bounds.push_back(0);
+    while (bounds.back() < size) {
+        size_t end = bounds.back() + CHUNK;
+        const char *nl = end < size
+                             ? (const char *)memchr(s + end, '\n', size - end)
+                             : nullptr;
+        bounds.push_back(nl ? nl - s + 1 : size);
+    }
+}
+
+// Lines as getline() reads them: a final newline ends the last line
+void FrontEnd::parseChunk(size_t c, Chunk &chunk) {
+    const char *s = text.data();
+    size_t pos = bounds[c], end = bounds[c + 1];
+    chunk.code.clear();
+    chunk.invalid = false;
+    while (pos < end) {
+        const char *nl = (const char *)memchr(s + pos, '\n', end - pos);
+        size_t stop = nl ? nl - s : end;
+        string line(s + pos, stop - pos);
+        try {
+            chunk.code.push_back(parse(line));
+        } catch (InvalidInstruction &e) {
+            chunk.invalid = true;
+            chunk.line = line;
+            return;
+        }
+        pos = stop + 1;
+    }
+}
+
+void FrontEnd::work(int id) {
+    Ring &ring = rings[id];
+    for (size_t c = id; c + 1 < bounds.size(); c += threads) {
+        unsigned int tail = ring.tail.load(memory_order_relaxed);
+        while (tail - ring.head.load(memory_order_acquire) == RING) {
+            if (stop)
+                return;
+            this_thread::yield();
+        }
+        parseChunk(c, ring.slots[tail % RING]);
+        ring.tail.store(tail + 1, memory_order_release);
+    }
+}
+
+// Moves the next chunk into `chunk`; false once the script is exhausted
+bool FrontEnd::pop(Chunk &chunk) {
+    if (next + 1 >= bounds.size())
+        return false;
+    if (threads <= 0) {
+        parseChunk(next++, chunk);
+        return true;
+    }
+
+    Ring &ring = rings[next++ % threads];
+    unsigned int head = ring.head.load(memory_order_relaxed);
+    while (ring.tail.load(memory_order_acquire) == head)
+        this_thread::yield();
+    swap(chunk, ring.slots[head % RING]);
+    ring.head.store(head + 1, memory_order_release);
+    return true;
+}
+
+// TypeCheck
+int TypeCheck::getType(string type) {
+    static const regex string("string");
+    static const regex number("number");
+    static const regex function(
+        "\\(((number|string)(,number|,string)*)?\\)->(number|string)");
+
+    if (regex_match(type, number))
+        return 0;
+    if (regex_match(type, string))
+        return 1;
+    if (regex_match(type, function))
+        return 2;
+
+    return -1;
+}
+
+template <class R> string TypeCheck::paraTypes(string para, R &resolver) {
+    static const regex number("\\d+");
+    static const regex str("\'[A-Za-z0-9 ]*\'");
+    static const regex var("[a-z][\\w]*");
+
+    vector<string> args;
+    string sub = "";
+    for (unsigned int i = 0; i < para.length(); i++) {
+        if (para[i] != ',') {
+            sub += para[i];
+        }
+        if (para[i] == ',' || i == para.length() - 1) {
+            args.push_back(sub);
+            sub = "";
+        }
+    }
+
+    vector<string> vars;
+    for (unsigned int i = 0; i < args.size(); i++)
+        if (regex_match(args[i], var))
+            vars.push_back(args[i]);
+    sort(vars.begin(), vars.end());
+    vars.erase(unique(vars.begin(), vars.end()), vars.end());
+    resolver.expect(vars);
+
+    string res = "";
+    for (unsigned int i = 0; i < args.size(); i++) {
+        if (regex_match(args[i], number))
+            res += "number,";
+        else if (regex_match(args[i], str))
+            res += "string,";
+        else if (regex_match(args[i], var)) {
+            const Symbol *x = resolver.find(args[i]);
+            if (!x)
+                return "undeclared";
+            if (x->type == 0)
+                res += "number,";
+            else if (x->type == 1)
+                res += "string,";
+        } else
+            return "error";
+    }
+    if (res != " ")
+        return res.substr(0, res.size() - 1);
+    return "";
+}
+
+template <class R>
+void TypeCheck::assign(const Instruction &ins, R &resolver) {
+    smatch m1;
+    const string &name = ins.name;
+    const string &value = ins.value;
+
+    // Regex
+    static const regex number("\\d+");
+    static const regex str("\'[A-Za-z0-9 ]*\'");
+    static const regex var("[a-z][\\w]*");
+    static const regex function_call("([^ ]*)\\((.*)\\)");
+
+    // Get type of value
+    // number, string
+    if (regex_match(value, number) || regex_match(value, str)) {
+        const Symbol *res = resolver.find(name);
+        int type = regex_match(value, number) ? 0 : 1;
+        if (res == nullptr || res->name.compare(name) != 0)
+            throw Undeclared(ins.str());
+        if (res->type != type)
+            throw TypeMismatch(ins.str());
+
+        return;
+    }
+    // variable
+    if (regex_match(value, var)) {
+        // Check value first
+        const Symbol *s = resolver.find(value);
+        if (!s || s->name.compare(value) != 0)
+            throw Undeclared(ins.str());
+        // Search for name
+        const Symbol *des = resolver.find(name);
+        if (!des || des->name.compare(name) != 0)
+            throw Undeclared(ins.str());
+        // Check type
+        if (des->type != s->type)
+            throw TypeMismatch(ins.str());
+
+        return;
+    }
+    // Function call
+    if (regex_match(value, m1, function_call)) {
+        smatch m2;
+        string f_name = m1.str(1);
+        string para = m1.str(2);
+        string para_pattern;
+        string return_type;
+
+        // Search for function name
+        const Symbol *s = resolver.find(f_name);
+        if (!s || s->name.compare(f_name) != 0)
+            throw Undeclared(ins.str());
+        if (s->type != 2)
+            throw TypeMismatch(ins.str());
+
+        static const regex function_pattern(
+            "\\(((number|string)(,number|,string)*)?\\)->(number|string)");
+        if (regex_match(s->para, m2, function_pattern)) {
+            para_pattern = m2.str(1);
+            return_type = m2.str(m2.size() - 1);
+        }
+
+        para = paraTypes(para, resolver);
+        // Check para pass valid with function
+        if (para == "error")
+            throw TypeMismatch(ins.str());
+        if (para == "undeclared")
+            throw Undeclared(ins.str());
+        if (para.compare(para_pattern) != 0) {
+            throw TypeMismatch(ins.str());
+        }
+        // Search for name
+        const Symbol *des = resolver.find(name);
+        if (!des || des->name != name)
+            throw Undeclared(ins.str());
+        // Check return type
+        if (des->type != getType(return_type))
+            throw TypeMismatch(ins.str());
+
+        return;
+    }
+
+    throw InvalidInstruction(ins.str());
+}
+
+// FrozenTable
+bool FrozenTable::innermostFirst(Symbol *a, Symbol *b) {
+    int order = a->name.compare(b->name);
+    return order < 0 || (order == 0 && a->level > b->level);
+}
+
+FrozenTable::FrozenTable(vector<Symbol *> all) {
+    sort(all.begin(), all.end(), innermostFirst);
+    vector<Symbol *> visible;
+    for (unsigned int i = 0; i < all.size(); i++)
+        if (i == 0 || all[i]->name != all[i - 1]->name)
+            visible.push_back(all[i]);
+
+    keys.resize(visible.size() + 1);
+    symbols.resize(visible.size() + 1, Symbol("", 0, -1));
+    size_t next = 0;
+    build(visible, next, 1);
+}
+
+// In-order fill of the implicit tree rooted at k
+void FrozenTable::build(const vector<Symbol *> &sorted, size_t &next,
+                        size_t k) {
+    if (k >= keys.size())
+        return;
+    build(sorted, next, 2 * k);
+    const Symbol *s = sorted[next++];
+    keys[k] = s->name;
+    symbols[k] = Symbol(s->name, s->level, s->type);
+    symbols[k].para = s->para;
+    build(sorted, next, 2 * k + 1);
+}
+
+int FrozenTable::size() const { return keys.size() - 1; }
+
+// Lower bound descent: go right past every smaller key, then undo the
+// trailing right turns to land on the first key not below `name`
+const Symbol *FrozenTable::find(const string &name) const {
+    size_t n = keys.size(), k = 1;
+    while (k < n)
+        k = 2 * k + (keys[k] < name);
+    k >>= __builtin_ffsll(~k);
+    if (k && keys[k] == name)
+        return &symbols[k];
+    return nullptr;
+}
+
+const Symbol *FrozenTable::Resolver::find(const string &name) const {
+    return table->find(name);
+}
+
+Result FrozenTable::resolve(string name) const {
+    Instruction ins(OP_LOOKUP, name);
+    const Symbol *res = find(name);
+    if (res == nullptr)
+        throw Undeclared(ins.str());
+
+    Result r(OP_LOOKUP);
+    r.level = res->level;
+    return r;
+}
+
+Result FrozenTable::checkAssign(string name, string value) const {
+    Resolver resolver = {this};
+    TypeCheck::assign(Instruction(OP_ASSIGN, name, value), resolver);
+    return Result(OP_ASSIGN);
+}
+
+// GlobalRegistry
+GlobalRegistry::GlobalRegistry() {
+    this->current = new Runs();
+    this->epoch = 0;
+    this->readers[0] = this->readers[1] = 0;
+}
+
+GlobalRegistry::~GlobalRegistry() {
+    const Runs *runs = current.load();
+    for (unsigned int i = 0; i < runs->size(); i++) {
+        for (unsigned int j = 0; j < (*runs)[i]->size(); j++)
+            delete (*(*runs)[i])[j];
+        delete (*runs)[i];
+    }
+    delete runs;
+}
+
+bool GlobalRegistry::byName(Symbol *s, const string &name) {
+    return s->name < name;
+}
+
+bool GlobalRegistry::ordered(Symbol *a, Symbol *b) {
+    return a->name < b->name;
+}
+
+Symbol *GlobalRegistry::find(const Runs *runs, const string &name) {
+    for (unsigned int i = 0; i < runs->size(); i++) {
+        const vector<Symbol *> &run = *(*runs)[i];
+        vector<Symbol *>::const_iterator it =
+            lower_bound(run.begin(), run.end(), name, byName);
+        if (it != run.end() && (*it)->name == name)
+            return *it;
     }
+    return nullptr;
+}
 
-    cout << num_comp << " " << num_splay << endl;
+// The epoch is checked again after announcing, so a reader never counts
+// itself on a parity whose writer has already stopped waiting
+unsigned int GlobalRegistry::enter() {
+    while (true) {
+        unsigned int e = epoch.load();
+        readers[e & 1]++;
+        if (epoch.load() == e)
+            return e;
+        readers[e & 1]--;
+    }
 }
 
-void SymbolTable::assign(smatch m) {
-    smatch m1;
-    int num_comp = 0;
-    int num_splay = 0;
-    string line = m.str(0);
-    string name = m.str(1);
-    string value = m.str(2);
+void GlobalRegistry::leave(unsigned int e) { readers[e & 1]--; }
+
+// The symbol registered under the name: s, which the registry then owns,
+// or the one declared before, in which case s stays with the caller
+Symbol *GlobalRegistry::declare(Symbol *s) {
+    lock_guard<mutex> lock(writer);
+    const Runs *old = current.load();
+    Symbol *had = find(old, s->name);
+    if (had)
+        return had;
+
+    // Runs no larger than the new one are merged into it; they stay
+    // readable through the old list until its readers are gone
+    Runs *next = new Runs(*old);
+    Runs retired;
+    vector<Symbol *> *run = new vector<Symbol *>(1, s);
+    while (!next->empty() && next->back()->size() <= run->size()) {
+        const vector<Symbol *> *last = next->back();
+        vector<Symbol *> *merged =
+            new vector<Symbol *>(last->size() + run->size());
+        merge(last->begin(), last->end(), run->begin(), run->end(),
+              merged->begin(), ordered);
+        delete run;
+        run = merged;
+        retired.push_back(last);
+        next->pop_back();
+    }
+    next->push_back(run);
+
+    current.store(next);
+    unsigned int e = epoch++;
+    while (readers[e & 1].load() > 0)
+        this_thread::yield();
+    for (unsigned int i = 0; i < retired.size(); i++)
+        delete retired[i];
+    delete old;
+    return s;
+}
 
-    // Regex
-    regex number("\\d+");
-    regex str("\'[A-Za-z0-9 ]*\'");
-    regex var("[a-z][\\w]*");
-    regex function_call("([^ ]*)\\((.*)\\)");
+Symbol *GlobalRegistry::find(const string &name) {
+    unsigned int e = enter();
+    Symbol *res = find(current.load(), name);
+    leave(e);
+    return res;
+}
 
-    // Get type of value
-    // number, string
-    if (regex_match(value, number) || regex_match(value, str)) {
-        Symbol *res = search(name, num_comp, num_splay);
-        int type = regex_match(value, number) ? 0 : 1;
-        if (res == nullptr || res->name.compare(name) != 0)
-            throw Undeclared(line);
-        if (res->type != type)
-            throw TypeMismatch(line);
+// Every registered name starting with the prefix, in name order
+vector<Symbol *> GlobalRegistry::complete(const string &prefix) {
+    vector<Symbol *> res;
+    unsigned int e = enter();
+    const Runs *runs = current.load();
+    for (unsigned int i = 0; i < runs->size(); i++) {
+        const vector<Symbol *> &run = *(*runs)[i];
+        for (vector<Symbol *>::const_iterator it =
+                 lower_bound(run.begin(), run.end(), prefix, byName);
+             it != run.end() && (*it)->name.compare(0, prefix.size(),
+                                                    prefix) == 0;
+             it++)
+            res.push_back(*it);
+    }
+    leave(e);
+    sort(res.begin(), res.end(), ordered);
+    return res;
+}
+
+template <class Visit> void GlobalRegistry::forEach(Visit visit) {
+    unsigned int e = enter();
+    const Runs *runs = current.load();
+    for (unsigned int i = 0; i < runs->size(); i++)
+        for (unsigned int j = 0; j < (*runs)[i]->size(); j++)
+            visit((*(*runs)[i])[j]);
+    leave(e);
+}
+
+int GlobalRegistry::size() {
+    unsigned int e = enter();
+    const Runs *runs = current.load();
+    int res = 0;
+    for (unsigned int i = 0; i < runs->size(); i++)
+        res += (*runs)[i]->size();
+    leave(e);
+    return res;
+}
+
+// BasicSymbolTable
+template <class Index>
+BasicSymbolTable<Index>::BasicSymbolTable(const Options &opts,
+                                          GlobalRegistry *globals) {
+    this->cur_level = 0;
+    this->opts = opts;
+    this->globals = globals;
+    this->base = nullptr;
+    this->memo_hand = 0;
+    this->memo_hits = this->memo_misses = 0;
+    this->laid_out = 0;
+    this->unsettled = false;
+    this->depth_before = this->depth_after = 0;
+    this->churn = 0;
+    this->compactions = 0;
+    this->indexed = false;
+    index.configure(opts);
+    filter.resize(opts.filter_bits);
+    cache.resize(opts.counters ? 0 : opts.cache_bits);
+    if (!opts.store.empty())
+        SymbolStore::open(opts.store); // no-op once main has opened it
+
+    // A profile is a line "name count" per global
+    ifstream profile(opts.profile_in);
+    string name;
+    double count;
+    while (profile >> name >> count)
+        weights[name] += count;
+}
+
+// The access counts of the globals go out when the table is done
+template <class Index> BasicSymbolTable<Index>::~BasicSymbolTable() {
+    if (opts.profile_out.empty())
+        return;
+    ofstream profile(opts.profile_out);
+    for (unordered_map<string, long long>::iterator it = accesses.begin();
+         it != accesses.end(); it++)
+        profile << it->first << " " << it->second << "\n";
+}
+
+// Unprofiled globals and every local weigh one access
+template <class Index>
+double BasicSymbolTable<Index>::Weight::operator()(Symbol *s) const {
+    if (s->level != 0)
+        return 1;
+    unordered_map<string, double>::const_iterator it = weights->find(s->name);
+    return 1 + (it == weights->end() ? 0 : it->second);
+}
+
+// Globals bulk loaded with a profile are laid out by it right before the
+// first instruction that is not a declaration, so a prelude arriving in
+// several batches is laid out once
+template <class Index> void BasicSymbolTable<Index>::settle() {
+    if (!unsettled)
+        return;
+    this->unsettled = false;
+    settle(index);
+}
+
+template <class Index>
+template <class I>
+void BasicSymbolTable<Index>::settle(I &) {}
+
+template <class Index> void BasicSymbolTable<Index>::settle(SplayTree &idx) {
+    Weight weight = {&weights};
+    this->depth_before = idx.expectedDepth(weight);
+    idx.reshape(weight);
+    this->depth_after = idx.expectedDepth(weight);
+    this->laid_out = level_size.empty() ? 0 : level_size[0];
+}
+
+// Inserts and frees scatter the nodes over the heap; after `compact` of
+// them the next read moves them back together
+template <class Index> void BasicSymbolTable<Index>::compactIfDue() {
+    if (opts.compact > 0 && churn >= opts.compact)
+        compact();
+}
+
+template <class Index> void BasicSymbolTable<Index>::compact() {
+    this->churn = 0;
+    compact(index);
+}
+
+template <class Index>
+template <class I>
+void BasicSymbolTable<Index>::compact(I &) {}
+
+// Cached symbols have moved, so every level's cache entries expire
+template <class Index>
+void BasicSymbolTable<Index>::compact(SplayTree &idx) {
+    idx.compact();
+    this->compactions++;
+    if (cache.enabled())
+        for (unsigned int i = 0; i < occupied.size(); i++)
+            cache.expire(occupied[i]);
+}
+
+// Counts an access to a global for the profile
+template <class Index> Symbol *BasicSymbolTable<Index>::touch(Symbol *s) {
+    if (s && s->level == 0 && !opts.profile_out.empty())
+        accesses[s->name]++;
+    return s;
+}
+
+template <class Index>
+const Index &BasicSymbolTable<Index>::getIndex() const {
+    return this->index;
+}
+
+template <class Index> int BasicSymbolTable<Index>::getType(string type) {
+    return TypeCheck::getType(type);
+}
+
+template <class Index>
+string BasicSymbolTable<Index>::getParaType(string para, int &num_comp,
+                                            int &num_splay) {
+    Resolver resolver = {this, num_comp, num_splay, vector<string>(),
+                         vector<Symbol *>()};
+    return TypeCheck::paraTypes(para, resolver);
+}
+
+template <class Index>
+Symbol *BasicSymbolTable<Index>::Resolver::find(const string &name) {
+    vector<string>::iterator it = lower_bound(names.begin(), names.end(), name);
+    if (it != names.end() && *it == name)
+        return found[it - names.begin()];
+    return table->search(name, num_comp, num_splay);
+}
 
-        cout << num_comp << " " << num_splay << endl;
+// With counters every search has to happen in order as it splays
+template <class Index>
+void BasicSymbolTable<Index>::Resolver::expect(const vector<string> &names) {
+    if (table->opts.counters)
         return;
+    this->names = names;
+    table->resolveAll(this->names, found);
+}
+
+// Only the reference splay tree has search paths worth prefetching; the
+// other engines skip the lookahead walk altogether
+template <class Index>
+template <class I>
+int BasicSymbolTable<Index>::lookahead(const Options &, I &) {
+    return 0;
+}
+
+template <class Index>
+int BasicSymbolTable<Index>::lookahead(const Options &opts, SplayTree &) {
+    return opts.lookahead;
+}
+
+template <class Index>
+template <class I>
+Symbol *BasicSymbolTable<Index>::prefetch(Symbol *, const string &, int,
+                                          I &) {
+    return nullptr;
+}
+
+template <class Index>
+Symbol *BasicSymbolTable<Index>::prefetch(Symbol *at, const string &name,
+                                          int level, SplayTree &idx) {
+    return idx.prefetch(at, name, level);
+}
+
+template <class Index>
+void BasicSymbolTable<Index>::printStats(ostream &out) const {
+    if (filter.enabled())
+        filter.printStats(out);
+    if (cache.enabled())
+        cache.printStats(out);
+    if (opts.memo > 0) {
+        long long total = memo_hits + memo_misses;
+        out << "memo: " << total << " blocks, " << memo_hits << " replayed ("
+            << (total ? 100.0 * memo_hits / total : 0) << "%)" << endl;
     }
-    // variable
-    if (regex_match(value, var)) {
-        // Check value first
-        Symbol *s = search(value, num_comp, num_splay);
-        if (!s || s->name.compare(value) != 0)
-            throw Undeclared(line);
-        // Search for name
-        Symbol *des = search(name, num_comp, num_splay);
-        if (!des || des->name.compare(name) != 0)
-            throw Undeclared(line);
-        // Check type
-        if (des->type != s->type)
-            throw TypeMismatch(line);
+    if (laid_out > 0)
+        out << "layout: " << laid_out << " globals, expected depth "
+            << depth_before << " before, " << depth_after << " after" << endl;
+    if (compactions > 0)
+        out << "compact: " << compactions << " passes" << endl;
+}
+
+// Called by the index for every symbol it frees on scope exit
+template <class Index> void BasicSymbolTable<Index>::dropped(Symbol *s) {
+    this->churn++;
+    if (indexed)
+        trie.erase(s->name, s->level);
+    if (filter.enabled())
+        filter.remove(s->name);
+}
+
+// The type as declared: number, string or the function signature
+template <class Index> string BasicSymbolTable<Index>::typeName(Symbol *s) {
+    return s->type == 0 ? "number" : s->type == 1 ? "string" : s->para;
+}
 
-        cout << num_comp << " " << num_splay << endl;
+template <class Index> void BasicSymbolTable<Index>::occupy(int level) {
+    if ((int)level_size.size() <= level)
+        level_size.resize(level + 1, 0);
+    this->churn++;
+    if (level_size[level]++ > 0)
         return;
+
+    // New levels are either the current one or the global one
+    if (level == 0)
+        occupied.insert(occupied.begin(), 0);
+    else
+        occupied.push_back(level);
+}
+
+// Only occupied levels are probed. A run of empty levels is probed once, at
+// its top, when counters are on: the splay engine counts the descent of a
+// miss that ends on a same-named node, and every level of the run ends on
+// the same node.
+template <class Index>
+template <class I>
+Symbol *BasicSymbolTable<Index>::search(string name, int &num_comp,
+                                        int &num_splay, I &idx) {
+    int top = this->cur_level;
+    for (int i = occupied.size() - 1; i >= -1; i--) {
+        int level = i >= 0 ? occupied[i] : -1;
+        if (opts.counters && top > level) {
+            Symbol *res = idx.search(name, top, num_comp, num_splay);
+            if (res)
+                return res;
+        }
+        if (level < 0)
+            break;
+
+        Symbol *res = idx.search(name, level, num_comp, num_splay);
+        if (res)
+            return res;
+        top = level - 1;
     }
-    // Function call
-    if (regex_match(value, m1, function_call)) {
-        smatch m2;
-        string f_name = m1.str(1);
-        string para = m1.str(2);
-        string para_pattern;
-        string return_type;
 
-        // Search for function name
-        Symbol *s = search(f_name, num_comp, num_splay);
-        if (!s || s->name.compare(f_name) != 0)
-            throw Undeclared(line);
-        if (s->type != 2)
-            throw TypeMismatch(line);
+    return NULL;
+}
 
-        regex function_pattern(
-            "\\(((number|string)(,number|,string)*)?\\)->(number|string)");
-        if (regex_match(s->para, m2, function_pattern)) {
-            para_pattern = m2.str(1);
-            return_type = m2.str(m2.size() - 1);
+// A miss costs no comparisons and no splay in any engine, so the filter
+// never changes the counters
+template <class Index>
+Symbol *BasicSymbolTable<Index>::search(string name, int &num_comp,
+                                        int &num_splay) {
+    if (filter.enabled() && !filter.mayContain(name))
+        return touch(global(name));
+    if (cache.enabled()) {
+        Symbol *res = cache.get(name);
+        if (res)
+            return touch(res);
+    }
+
+    Symbol *res = search(name, num_comp, num_splay, index);
+    if (res && cache.enabled())
+        cache.put(name, res);
+    if (res == NULL && (res = global(name)) == NULL && filter.enabled())
+        filter.missed();
+    return touch(res);
+}
+
+// Shared globals sit below every private level and cost no counters
+template <class Index>
+Symbol *BasicSymbolTable<Index>::global(const string &name) {
+    if (base) // never written through
+        return const_cast<Symbol *>(base->find(name));
+    return globals ? globals->find(name) : NULL;
+}
+
+template <class Index>
+Symbol *BasicSymbolTable<Index>::search(string name, int &num_comp,
+                                        int &num_splay, NameSplayTree &idx) {
+    return idx.resolve(name, cur_level, num_comp, num_splay);
+}
+
+// Uncounted resolution of sorted, distinct names; found[i] is null when
+// names[i] is undeclared
+template <class Index>
+void BasicSymbolTable<Index>::resolveAll(const vector<string> &names,
+                                         vector<Symbol *> &found) {
+    found.assign(names.size(), nullptr);
+    vector<string> rest;
+    vector<int> at;
+    for (unsigned int i = 0; i < names.size(); i++) {
+        if (filter.enabled() && !filter.mayContain(names[i]))
+            continue;
+        if (cache.enabled() && (found[i] = cache.get(names[i])))
+            continue;
+        rest.push_back(names[i]);
+        at.push_back(i);
+    }
+
+    vector<Symbol *> res(rest.size(), nullptr);
+    resolveAll(rest, res, index);
+    for (unsigned int i = 0; i < rest.size(); i++) {
+        found[at[i]] = res[i];
+        if (res[i] && cache.enabled())
+            cache.put(rest[i], res[i]);
+    }
+    for (unsigned int i = 0; i < names.size(); i++)
+        touch(found[i] ? found[i] : (found[i] = global(names[i])));
+    // The filter only missed if the registry had nothing either
+    for (unsigned int i = 0; i < rest.size(); i++)
+        if (found[at[i]] == nullptr && filter.enabled())
+            filter.missed();
+}
+
+template <class Index>
+template <class I>
+void BasicSymbolTable<Index>::resolveAll(const vector<string> &names,
+                                         vector<Symbol *> &found, I &idx) {
+    for (unsigned int i = 0; i < names.size(); i++)
+        found[i] = lookup(names[i], idx);
+}
+
+// One multi-search per occupied level, innermost first, for the names still
+// unresolved
+template <class Index>
+void BasicSymbolTable<Index>::resolveAll(const vector<string> &names,
+                                         vector<Symbol *> &found,
+                                         SplayTree &idx) {
+    vector<string> pending = names;
+    vector<int> at(names.size());
+    for (unsigned int i = 0; i < at.size(); i++)
+        at[i] = i;
+
+    for (int i = occupied.size() - 1; i >= 0 && !pending.empty(); i--) {
+        vector<Symbol *> hit(pending.size(), nullptr);
+        idx.lookupAll(occupied[i], pending, hit);
+        unsigned int k = 0;
+        for (unsigned int j = 0; j < pending.size(); j++) {
+            if (hit[j]) {
+                found[at[j]] = hit[j];
+            } else {
+                pending[k] = pending[j];
+                at[k++] = at[j];
+            }
         }
+        pending.resize(k);
+        at.resize(k);
+    }
+}
 
-        para = getParaType(para, num_comp, num_splay);
-        // Check para pass valid with function
-        if (para == "error")
-            throw TypeMismatch(line);
-        if (para == "undeclared")
-            throw Undeclared(line);
-        if (para.compare(para_pattern) != 0) {
-            throw TypeMismatch(line);
+template <class Index>
+Result BasicSymbolTable<Index>::insert(const Instruction &ins) {
+    string name = ins.name;
+    int type = ins.type;
+    int level = ins.is_static ? 0 : this->cur_level;
+
+    if (type == -1)
+        throw InvalidInstruction(ins.str());
+    if (type == 2 && level != 0)
+        throw InvalidDeclaration(ins.str());
+
+    Result r(OP_INSERT);
+    Symbol *new_symbol = new Symbol(name, level, type);
+    if (type == 2) {
+        new_symbol->para = ins.value;
+    }
+
+    // Static declarations are shared; every other session loading the same
+    // one finds it satisfied, while a second one from this session is
+    // redeclared as it would be without a registry. Other globals stay with
+    // the session.
+    if (ins.is_static && globals) {
+        if (index.peek(name, 0) || shared.count(name)) {
+            delete new_symbol;
+            throw Redeclared(ins.str());
         }
-        // Search for name
-        Symbol *des = search(name, num_comp, num_splay);
-        if (!des || des->name != name)
-            throw Undeclared(line);
-        // Check return type
-        if (des->type != getType(return_type))
-            throw TypeMismatch(line);
+        Symbol *had = globals->declare(new_symbol);
+        if (had != new_symbol) {
+            bool same = had->type == type && had->para == new_symbol->para;
+            delete new_symbol;
+            if (!same)
+                throw Redeclared(ins.str());
+        }
+        shared.insert(name);
+        if (cache.enabled())
+            cache.forget(name);
+        return r;
+    }
+    if (level == 0 && globals && globals->find(name)) {
+        delete new_symbol;
+        throw Redeclared(ins.str());
+    }
+
+    if (!index.insert(new_symbol, r.num_comp, r.num_splay)) {
+        delete new_symbol;
+        throw Redeclared(ins.str());
+    }
+    occupy(level);
+    if (indexed)
+        trie.insert(name, level, typeName(new_symbol));
+    if (filter.enabled())
+        filter.add(name);
+    if (cache.enabled())
+        cache.forget(name);
+
+    return r;
+}
+
+// Runs the INSERTs starting at `begin` as one batch; returns where they end
+template <class Index>
+size_t BasicSymbolTable<Index>::insertRun(const vector<Instruction> &code,
+                                          size_t begin) {
+    size_t end = begin;
+    while (end < code.size() && code[end].op == OP_INSERT)
+        end++;
+    insertAll(code, begin, end);
+    return end;
+}
 
-        cout << num_comp << " " << num_splay << endl;
+// Declares code[begin, end) as if inserted one by one, failing at the
+// first INSERT that would fail. With counters, or with shared globals, they
+// really are.
+template <class Index>
+void BasicSymbolTable<Index>::insertAll(const vector<Instruction> &code,
+                                        size_t begin, size_t end) {
+    if (opts.counters || globals) {
+        for (size_t k = begin; k < end; k++)
+            insert(code[k]);
         return;
     }
+    insertAll(code, begin, end, index);
+}
+
+template <class Index>
+template <class I>
+void BasicSymbolTable<Index>::insertAll(const vector<Instruction> &code,
+                                        size_t begin, size_t end, I &) {
+    for (size_t k = begin; k < end; k++)
+        insert(code[k]);
+}
+
+// Bulk load: the batch is sorted by (level, name) and checked as a whole,
+// then every declaration in front of the first failing one goes into the
+// tree at once; that one is finally inserted alone to throw its error
+template <class Index>
+void BasicSymbolTable<Index>::insertAll(const vector<Instruction> &code,
+                                        size_t begin, size_t end,
+                                        SplayTree &idx) {
+    size_t bad = end;
+    for (size_t k = begin; k < end && bad == end; k++) {
+        int level = code[k].is_static ? 0 : this->cur_level;
+        if (code[k].type == -1 || (code[k].type == 2 && level != 0))
+            bad = k;
+    }
+
+    // Symbols are made in script order; their keys carry the first eight
+    // name bytes, big-endian, so most of the sort compares integers instead
+    // of chasing names
+    struct Key {
+        int level;
+        unsigned long long prefix;
+        size_t at;
+        Symbol *symbol;
+    };
+    vector<Key> order(bad - begin);
+    for (size_t k = begin; k < bad; k++) {
+        const Instruction &ins = code[k];
+        Key &key = order[k - begin];
+        key.level = ins.is_static ? 0 : this->cur_level;
+        key.prefix = 0;
+        for (int i = 0; i < 8; i++)
+            key.prefix = key.prefix << 8 |
+                         (i < (int)ins.name.size() ? (unsigned char)ins.name[i]
+                                                   : 0);
+        key.at = k;
+        key.symbol = new Symbol(ins.name, key.level, ins.type);
+        if (ins.type == 2)
+            key.symbol->para = ins.value;
+    }
+    parallelSort(
+        order,
+        [](const Key &a, const Key &b) {
+            if (a.level != b.level)
+                return a.level < b.level;
+            if (a.prefix != b.prefix)
+                return a.prefix < b.prefix;
+            int diff = a.symbol->name.compare(b.symbol->name);
+            return diff != 0 ? diff < 0 : a.at < b.at;
+        },
+        opts.threads);
+
+    // Twins are neighbours now and the later one is redeclared; a name
+    // already in the index fails at its first occurrence
+    for (size_t j = 1; j < order.size(); j++)
+        if (order[j].level == order[j - 1].level &&
+            order[j].prefix == order[j - 1].prefix &&
+            order[j].symbol->name == order[j - 1].symbol->name)
+            bad = min(bad, order[j].at);
+    for (size_t j = 0; j < order.size();) {
+        int level = order[j].level;
+        size_t from = j;
+        while (j < order.size() && order[j].level == level)
+            j++;
+        if (level >= (int)level_size.size() || level_size[level] == 0)
+            continue;
+        vector<string> names;
+        vector<size_t> first;
+        for (size_t k = from; k < j; k++)
+            if (names.empty() || names.back() != order[k].symbol->name) {
+                names.push_back(order[k].symbol->name);
+                first.push_back(order[k].at);
+            }
+        vector<Symbol *> found(names.size(), nullptr);
+        idx.lookupAll(level, names, found);
+        for (size_t k = 0; k < names.size(); k++)
+            if (found[k])
+                bad = min(bad, first[k]);
+    }
+
+    vector<Symbol *> symbols;
+    for (size_t j = 0; j < order.size(); j++) {
+        Symbol *s = order[j].symbol;
+        if (order[j].at >= bad) {
+            delete s;
+            continue;
+        }
+        symbols.push_back(s);
+        occupy(s->level);
+        if (indexed)
+            trie.insert(s->name, s->level, typeName(s));
+        if (filter.enabled())
+            filter.add(s->name);
+        if (cache.enabled())
+            cache.forget(s->name);
+    }
+    idx.insertAll(symbols);
+    if (!weights.empty() && !symbols.empty() && symbols[0]->level == 0)
+        this->unsettled = true;
+    if (bad < end)
+        insert(code[bad]);
+}
+
+// Retracts the innermost visible declaration of the name, found by the
+// counted search ASSIGN uses. Globals of the session's own go like any
+// other symbol; shared ones belong to every session, so none retracts one.
+// The frozen base needs no such check: REMOVE makes a block dependent, so
+// the speculative workers that have one never run it.
+template <class Index>
+Result BasicSymbolTable<Index>::remove(const Instruction &ins) {
+    settle();
+    Result r(OP_REMOVE);
+    Symbol *res = search(ins.name, r.num_comp, r.num_splay);
+    if (res == nullptr)
+        throw Undeclared(ins.str());
+    if (globals && res == global(ins.name))
+        throw SharedSymbol(ins.str());
+
+    int level = res->level;
+    if (filter.enabled())
+        filter.remove(ins.name);
+    if (cache.enabled())
+        cache.forget(ins.name);
+    index.erase(res);
+    this->churn++;
+    if (indexed)
+        trie.erase(ins.name, level);
+    if (--level_size[level] == 0)
+        occupied.erase(find(occupied.begin(), occupied.end(), level));
+    return r;
+}
+
+template <class Index>
+Result BasicSymbolTable<Index>::assign(const Instruction &ins) {
+    settle();
+    compactIfDue();
+    Result r(OP_ASSIGN);
+    Resolver resolver = {this, r.num_comp, r.num_splay, vector<string>(),
+                         vector<Symbol *>()};
+    TypeCheck::assign(ins, resolver);
+    return r;
+}
 
-    throw InvalidInstruction(line);
+// Drop every scope and every private symbol, so the table can run another
+// script; shared globals stay
+template <class Index> void BasicSymbolTable<Index>::reset() {
+    for (int i = occupied.size() - 1; i >= 0; i--) {
+        index.remove(occupied[i], [this](Symbol *s) { this->dropped(s); });
+        level_size[occupied[i]] = 0;
+        if (cache.enabled())
+            cache.expire(occupied[i]);
+    }
+    occupied.clear();
+    shared.clear();
+    this->cur_level = 0;
+    this->unsettled = false;
 }
 
-void SymbolTable::begin() { this->cur_level++; }
+template <class Index> void BasicSymbolTable<Index>::enterScope() {
+    this->cur_level++;
+}
 
-void SymbolTable::end() {
+template <class Index> void BasicSymbolTable<Index>::exitScope() {
     this->cur_level--;
     if (this->cur_level < 0)
         throw UnknownBlock();
-    this->remove(cur_level + 1);
+
+    int level = cur_level + 1;
+    if (level < (int)level_size.size() && level_size[level] > 0) {
+        index.remove(level, [this](Symbol *s) { this->dropped(s); });
+        if (cache.enabled())
+            cache.expire(level);
+        level_size[level] = 0;
+        occupied.pop_back();
+    }
 }
 
-void SymbolTable::lookup(smatch m) {
-    if (this->root == nullptr)
-        throw Undeclared(m.str(0));
+template <class Index>
+template <class I>
+Symbol *BasicSymbolTable<Index>::lookup(string name, I &idx) {
+    Symbol *res = nullptr;
+    for (int i = occupied.size() - 1; i >= 0 && !res; i--) {
+        res = idx.lookup(name, occupied[i]);
+    }
+    return res;
+}
 
-    string name = m.str(1);
+template <class Index>
+Symbol *BasicSymbolTable<Index>::lookup(string name, NameSplayTree &idx) {
+    int num_comp = 0, num_splay = 0;
+    return idx.resolve(name, cur_level, num_comp, num_splay);
+}
 
-    for (int level = cur_level; level >= 0; level--) {
-        if (h_lookup(name, level))
-            break;
+template <class Index>
+Result BasicSymbolTable<Index>::lookup(const Instruction &ins) {
+    settle();
+    compactIfDue();
+    Symbol *res = cache.enabled() ? cache.get(ins.name) : nullptr;
+    if (!res && (!filter.enabled() || filter.mayContain(ins.name))) {
+        res = lookup(ins.name, index);
+        if (res && cache.enabled())
+            cache.put(ins.name, res);
+        else if (res == nullptr && (res = global(ins.name)) == nullptr &&
+                 filter.enabled())
+            filter.missed();
     }
+    if (res == nullptr)
+        res = global(ins.name);
+
+    if (touch(res) == nullptr)
+        throw Undeclared(ins.str());
 
-    if (this->root->name != name)
-        throw Undeclared(m.str(0));
+    Result r(OP_LOOKUP);
+    r.level = res->level;
+    return r;
+}
 
-    cout << this->root->level << endl;
+// Snapshot of every visible symbol for read-only queries
+template <class Index> FrozenTable BasicSymbolTable<Index>::freeze() const {
+    vector<Symbol *> all;
+    index.forEach([&all](Symbol *s) { all.push_back(s); });
+    if (globals)
+        globals->forEach([&all](Symbol *s) { all.push_back(s); });
+    return FrozenTable(all);
 }
 
-void SymbolTable::print() {
-    string res = preorder(this->root);
+template <class Index> Result BasicSymbolTable<Index>::print() {
+    settle();
+    Result r(OP_PRINT);
+    string res = index.preorder();
     if (res != "") {
-        cout << res.substr(0, res.size() - 1) << endl;
+        r.text = res.substr(0, res.size() - 1);
+    }
+    return r;
+}
+
+// The first name query builds the trie from the index and it is kept up to
+// date from then on, so scripts that never ask do not pay for it. As with
+// PRINT, globals of a shared registry are not in it; forNames() merges
+// them in.
+template <class Index> void BasicSymbolTable<Index>::buildTrie() {
+    if (indexed)
+        return;
+    index.forEach([this](Symbol *s) {
+        this->trie.insert(s->name, s->level, typeName(s));
+    });
+    this->indexed = true;
+}
+
+// The innermost binding of every visible name starting with the prefix as
+// visit(name, level, type), in name order. The private trie is merged with
+// the shared globals, which its declarations of the same name shadow.
+template <class Index>
+template <class Visit>
+void BasicSymbolTable<Index>::forNames(const string &prefix, Visit visit) {
+    buildTrie();
+    vector<Symbol *> shared;
+    if (globals)
+        shared = globals->complete(prefix);
+    size_t k = 0;
+    trie.complete(prefix, [&](const string &name, int level,
+                              const string &type) {
+        for (; k < shared.size() && shared[k]->name < name; k++)
+            visit(shared[k]->name, 0, typeName(shared[k]));
+        if (k < shared.size() && shared[k]->name == name)
+            k++;
+        visit(name, level, type);
+    });
+    for (; k < shared.size(); k++)
+        visit(shared[k]->name, 0, typeName(shared[k]));
+}
+
+// Names visible here that start with the prefix, innermost declarations in
+// name order
+template <class Index>
+Result BasicSymbolTable<Index>::complete(const Instruction &ins) {
+    Result r(OP_COMPLETE);
+    forNames(ins.name, [&r](const string &name, int level, const string &) {
+        r.text += name + "//" + to_string(level) + " ";
+    });
+    if (r.text != "")
+        r.text.resize(r.text.size() - 1);
+    return r;
+}
+
+template <class Index>
+Result BasicSymbolTable<Index>::declare(string name, int type, string para,
+                            bool is_static) {
+    string type_str = type == 0 ? "number" : type == 1 ? "string" : para;
+    return insert(Instruction(OP_INSERT, name, type_str, type, is_static));
+}
+
+// Declares a batch of INSERTs in one go when counters are off, with the
+// outcome of inserting them one by one. Anything but an INSERT is invalid.
+template <class Index>
+vector<Result> BasicSymbolTable<Index>::declareAll(
+    const vector<Instruction> &batch) {
+    vector<Result> res;
+    size_t end = 0;
+    while (end < batch.size() && batch[end].op == OP_INSERT)
+        end++;
+    if (opts.counters) {
+        for (size_t k = 0; k < end; k++)
+            res.push_back(insert(batch[k]));
+    } else {
+        insertAll(batch, 0, end);
+        res.assign(end, Result(OP_INSERT));
+    }
+    if (end < batch.size())
+        throw InvalidInstruction(batch[end].str());
+    return res;
+}
+
+template <class Index>
+Result BasicSymbolTable<Index>::resolve(string name) {
+    return lookup(Instruction(OP_LOOKUP, name));
+}
+
+template <class Index>
+Result BasicSymbolTable<Index>::complete(string prefix) {
+    return complete(Instruction(OP_COMPLETE, prefix));
+}
+
+// Every visible binding as visit(name, level, type) in name order: one walk
+// of the trie, whose stacks already resolve the shadowing, with nothing
+// splayed; shared globals come in at level 0 unless shadowed
+template <class Index>
+template <class Visit>
+void BasicSymbolTable<Index>::forVisible(Visit visit) {
+    forNames("", visit);
+}
+
+template <class Index> Result BasicSymbolTable<Index>::visible() {
+    Result r(OP_VISIBLE);
+    forVisible([&r](const string &name, int level, const string &type) {
+        r.text += name + "//" + to_string(level) + "//" + type + " ";
+    });
+    if (r.text != "")
+        r.text.resize(r.text.size() - 1);
+    return r;
+}
+
+// The VISIBLE line written as the walk goes, for run()
+template <class Index> void BasicSymbolTable<Index>::visible(ostream &out) {
+    bool first = true;
+    forVisible([&](const string &name, int level, const string &type) {
+        out << (first ? "" : " ") << name << "//" << level << "//" << type;
+        first = false;
+    });
+    if (!first)
+        out << endl;
+}
+
+template <class Index>
+Result BasicSymbolTable<Index>::undeclare(string name) {
+    return remove(Instruction(OP_REMOVE, name));
+}
+
+template <class Index>
+Result BasicSymbolTable<Index>::checkAssign(string name, string value) {
+    return assign(Instruction(OP_ASSIGN, name, value));
+}
+
+template <class Index>
+Result BasicSymbolTable<Index>::execute(const Instruction &ins) {
+    switch (ins.op) {
+    case OP_INSERT:
+        return insert(ins);
+    case OP_ASSIGN:
+        return assign(ins);
+    case OP_LOOKUP:
+        return lookup(ins);
+    case OP_BEGIN:
+        enterScope();
+        break;
+    case OP_END:
+        exitScope();
+        break;
+    case OP_PRINT:
+        return print();
+    case OP_REMOVE:
+        return remove(ins);
+    case OP_COMPLETE:
+        return complete(ins);
+    case OP_VISIBLE:
+        return visible();
     }
+    return Result(ins.op);
+}
+
+template <class Index>
+vector<Result> BasicSymbolTable<Index>::execute(const vector<Instruction> &batch) {
+    vector<Result> res;
+    res.reserve(batch.size());
+    for (unsigned int i = 0; i < batch.size(); i++)
+        res.push_back(execute(batch[i]));
+    return res;
 }
 
-void SymbolTable::run(string filename) {
+template <class Index>
+Instruction BasicSymbolTable<Index>::parse(string s) {
     // Regex
     smatch m;
-    regex insert_expr("INSERT ([a-z][\\w]*) ([^ ]*) (true|false)");
-    regex assign_expr("ASSIGN ([a-z][\\w]*) (.*)");
-    regex begin_expr("BEGIN");
-    regex end_expr("END");
-    regex lookup_expr("LOOKUP ([a-z][\\w]*)");
-    regex print_expr("PRINT");
-    regex remove_expr("REMOVE ([a-z][\\w]*)");
-
-    // Read file
-    string s;
+    static const regex insert_expr("INSERT ([a-z][\\w]*) ([^ ]*) (true|false)");
+    static const regex assign_expr("ASSIGN ([a-z][\\w]*) (.*)");
+    static const regex begin_expr("BEGIN");
+    static const regex end_expr("END");
+    static const regex lookup_expr("LOOKUP ([a-z][\\w]*)");
+    static const regex print_expr("PRINT");
+    static const regex remove_expr("REMOVE ([a-z][\\w]*)");
+    static const regex complete_expr("COMPLETE(?: ([a-z][\\w]*))?");
+    static const regex visible_expr("VISIBLE");
+
+    if (regex_match(s, m, insert_expr))
+        return Instruction(OP_INSERT, m.str(1), m.str(2), getType(m.str(2)),
+                           m.str(3) == "true");
+    if (regex_match(s, m, assign_expr))
+        return Instruction(OP_ASSIGN, m.str(1), m.str(2));
+    if (regex_match(s, m, lookup_expr))
+        return Instruction(OP_LOOKUP, m.str(1));
+    if (regex_match(s, m, begin_expr))
+        return Instruction(OP_BEGIN);
+    if (regex_match(s, m, end_expr))
+        return Instruction(OP_END);
+    if (regex_match(s, m, print_expr))
+        return Instruction(OP_PRINT);
+    if (regex_match(s, m, remove_expr))
+        return Instruction(OP_REMOVE, m.str(1));
+    if (regex_match(s, m, complete_expr))
+        return Instruction(OP_COMPLETE, m.str(1));
+    if (regex_match(s, m, visible_expr))
+        return Instruction(OP_VISIBLE);
+
+    throw InvalidInstruction(s);
+}
+
+template <class Index>
+void BasicSymbolTable<Index>::run(string filename) {
     ifstream file(filename);
-    while (getline(file, s)) {
-        if (regex_match(s, m, insert_expr)) {
-            this->insert(m);
-        } else if (regex_match(s, m, assign_expr)) {
-            this->assign(m);
-        } else if (regex_match(s, m, lookup_expr)) {
-            this->lookup(m);
-        } else if (regex_match(s, m, begin_expr)) {
-            this->begin();
-        } else if (regex_match(s, m, end_expr)) {
-            this->end();
-        } else if (regex_match(s, m, print_expr)) {
-            this->print();
-        } else {
-            throw InvalidInstruction(s);
+    run(file, cout);
+}
+
+// One past the END closing the BEGIN at `begin`, 0 if there is none
+template <class Index>
+size_t BasicSymbolTable<Index>::blockEnd(const vector<Instruction> &code,
+                                         size_t begin) {
+    if (begin >= code.size() || code[begin].op != OP_BEGIN)
+        return 0;
+    int depth = 0;
+    for (size_t i = begin; i < code.size(); i++) {
+        if (code[i].op == OP_BEGIN)
+            depth++;
+        else if (code[i].op == OP_END && --depth == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+// Nothing in a block outlives its END but static declarations and outer
+// ones it retracts, and only PRINT depends on the shape of the tree. Any
+// REMOVE counts, as it may reach past the block's own declarations, and so
+// do COMPLETE and VISIBLE, which list outer names the block need not
+// mention.
+template <class Index>
+bool BasicSymbolTable<Index>::independent(const vector<Instruction> &code,
+                                          size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+        if (code[i].op == OP_PRINT || code[i].op == OP_REMOVE ||
+            code[i].op == OP_COMPLETE || code[i].op == OP_VISIBLE ||
+            (code[i].op == OP_INSERT && code[i].is_static))
+            return false;
+    return true;
+}
+
+// Identifiers of an ASSIGN value, skipping string literals
+template <class Index>
+void BasicSymbolTable<Index>::identifiers(const string &value,
+                                          vector<string> &names) {
+    for (size_t i = 0; i < value.size();) {
+        if (value[i] == '\'') {
+            size_t close = value.find('\'', i + 1);
+            i = close == string::npos ? value.size() : close + 1;
+        } else if (isalnum(value[i]) || value[i] == '_') {
+            size_t from = i;
+            while (i < value.size() && (isalnum(value[i]) || value[i] == '_'))
+                i++;
+            if (islower(value[from]))
+                names.push_back(value.substr(from, i - from));
+        } else
+            i++;
+    }
+}
+
+// The text of a top-level block plus the outer binding of every identifier
+// it mentions: all the outcome of an independent block depends on. A
+// changed binding gives a new key, so stale entries are never hit. The
+// bindings are peeked at, so keying leaves the index as it was.
+template <class Index>
+string BasicSymbolTable<Index>::memoKey(const vector<Instruction> &code,
+                                        size_t begin, size_t end) {
+    string key;
+    vector<string> names;
+    for (size_t k = begin; k < end; k++) {
+        key += code[k].str() + "\n";
+        if (code[k].name != "")
+            names.push_back(code[k].name);
+        if (code[k].op == OP_ASSIGN)
+            identifiers(code[k].value, names);
+    }
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+
+    for (unsigned int k = 0; k < names.size(); k++) {
+        Symbol *s = nullptr;
+        for (int i = occupied.size() - 1; i >= 0 && !s; i--)
+            s = index.peek(names[k], occupied[i]);
+        if (s == nullptr)
+            s = global(names[k]);
+        key += names[k];
+        if (s)
+            key += "=" + to_string(s->level) + "," + to_string(s->type) +
+                   "," + s->para;
+        key += ";";
+    }
+    return key;
+}
+
+// Keeps a fresh outcome; when the memo is full, the clock hand clears the
+// reference bits it passes and evicts the first entry not replayed since
+template <class Index>
+void BasicSymbolTable<Index>::remember(const string &key,
+                                       const Outcome &outcome) {
+    if ((int)memo_clock.size() < opts.memo) {
+        memo_clock.push_back(key);
+        memo[key] = outcome;
+        return;
+    }
+    while (true) {
+        Outcome &old = memo[memo_clock[memo_hand]];
+        if (!old.recent)
+            break;
+        old.recent = false;
+        memo_hand = (memo_hand + 1) % memo_clock.size();
+    }
+    memo.erase(memo_clock[memo_hand]);
+    memo_clock[memo_hand] = key;
+    memo[key] = outcome;
+    memo_hand = (memo_hand + 1) % memo_clock.size();
+}
+
+// Runs a block on this table, keeping what it prints and how it fails
+template <class Index>
+void BasicSymbolTable<Index>::check(const vector<Instruction> &code,
+                                    size_t begin, size_t end,
+                                    Outcome &outcome) {
+    try {
+        for (size_t k = begin; k < end; k++) {
+            Result r = this->execute(code[k]);
+            if (!countersOnly(r))
+                outcome.results.push_back(r);
+        }
+    } catch (...) {
+        outcome.error = current_exception();
+    }
+}
+
+// Executor for runs without counters that treats independent top-level
+// blocks as units. With `memo`, a block whose key was seen before is not
+// run: its outcome is replayed. With `speculate`, consecutive blocks are
+// checked in parallel, each on a worker table that sees the globals through
+// a frozen snapshot. Outcomes and the first error are replayed in source
+// order; everything else runs here, in order, as run() would.
+template <class Index>
+void BasicSymbolTable<Index>::runBlocks(const vector<Instruction> &code,
+                                        ostream &out) {
+    size_t i = 0;
+    while (i < code.size()) {
+        vector<pair<size_t, size_t> > blocks;
+        size_t end = i;
+        while (this->cur_level == 0 &&
+               (blocks.empty() || opts.speculate > 0)) {
+            size_t next = blockEnd(code, end);
+            if (next == 0 || !independent(code, end, next))
+                break;
+            blocks.push_back(make_pair(end, next));
+            end = next;
+        }
+        bool parallel = opts.speculate > 0 && blocks.size() >= 2;
+        if (blocks.empty() || (!parallel && opts.memo == 0)) {
+            if (code[i].op == OP_INSERT) {
+                i = insertRun(code, i);
+                continue;
+            }
+            Result r = this->execute(code[i++]);
+            if (!countersOnly(r))
+                out << r;
+            continue;
         }
+
+        // Blocks with a remembered or an earlier identical key are not run
+        vector<Outcome> fresh(blocks.size());
+        vector<Outcome *> outcome(blocks.size());
+        vector<string> keys(blocks.size());
+        vector<size_t> todo;
+        unordered_map<string, size_t> first;
+        for (size_t b = 0; b < blocks.size(); b++) {
+            outcome[b] = &fresh[b];
+            if (opts.memo > 0) {
+                keys[b] = memoKey(code, blocks[b].first, blocks[b].second);
+                typename unordered_map<string, Outcome>::iterator hit =
+                    memo.find(keys[b]);
+                unordered_map<string, size_t>::iterator twin =
+                    first.find(keys[b]);
+                if (hit != memo.end() || twin != first.end()) {
+                    outcome[b] =
+                        hit != memo.end() ? &hit->second : &fresh[twin->second];
+                    if (hit != memo.end())
+                        hit->second.recent = true;
+                    memo_hits++;
+                    continue;
+                }
+                first[keys[b]] = b;
+                memo_misses++;
+            }
+            todo.push_back(b);
+        }
+
+        if (!parallel) {
+            for (size_t t = 0; t < todo.size(); t++)
+                check(code, blocks[todo[t]].first, blocks[todo[t]].second,
+                      fresh[todo[t]]);
+        } else if (!todo.empty()) {
+            FrozenTable snapshot = freeze();
+            atomic<size_t> taken(0);
+            vector<thread> workers;
+            int threads = min((size_t)opts.speculate, todo.size());
+            for (int t = 0; t < threads; t++)
+                workers.push_back(thread([&]() {
+                    Options local = opts;
+                    local.speculate = local.threads = local.memo = 0;
+                    local.profile_in = local.profile_out = "";
+                    BasicSymbolTable<Index> worker(local);
+                    worker.base = &snapshot;
+                    for (size_t k; (k = taken++) < todo.size();) {
+                        size_t b = todo[k];
+                        worker.check(code, blocks[b].first, blocks[b].second,
+                                     fresh[b]);
+                        worker.reset();
+                    }
+                }));
+            for (int t = 0; t < threads; t++)
+                workers[t].join();
+        }
+
+        for (size_t b = 0; b < blocks.size(); b++) {
+            for (size_t k = 0; k < outcome[b]->results.size(); k++)
+                out << outcome[b]->results[k];
+            if (outcome[b]->error)
+                rethrow_exception(outcome[b]->error);
+        }
+        for (size_t t = 0; opts.memo > 0 && t < todo.size(); t++)
+            remember(keys[todo[t]], fresh[todo[t]]);
+        i = end;
+    }
+}
+
+template <class Index>
+void BasicSymbolTable<Index>::run(istream &in, ostream &out) {
+    FrontEnd input(in, parse, opts.threads);
+    FrontEnd::Chunk chunk;
+    if (!opts.counters && (opts.speculate > 0 || opts.memo > 0)) {
+        vector<Instruction> code;
+        bool invalid = false;
+        while (!invalid && input.pop(chunk)) {
+            code.insert(code.end(), chunk.code.begin(), chunk.code.end());
+            invalid = chunk.invalid;
+        }
+        runBlocks(code, out);
+        if (invalid)
+            throw InvalidInstruction(chunk.line);
+    }
+    int ahead = lookahead(opts, index);
+    while (input.pop(chunk)) {
+        // After every instruction the search paths of the next `ahead`
+        // ones are walked a few nodes further, prefetching them, so most of
+        // a path is in cache by the time its instruction runs. Paths follow
+        // the name at the innermost occupied level and restart after END,
+        // REMOVE and compaction, which free nodes.
+        vector<Instruction> &code = chunk.code;
+        vector<Symbol *> at(code.size(), nullptr);
+        for (unsigned int i = 0; i < code.size(); i++) {
+            // Without counters a run of declarations is loaded as a batch,
+            // which reshapes the tree under the paths walked so far
+            if (!opts.counters && code[i].op == OP_INSERT &&
+                i + 1 < code.size() && code[i + 1].op == OP_INSERT) {
+                unsigned int end = insertRun(code, i);
+                unsigned int last = min(end + ahead, (unsigned int)code.size());
+                fill(at.begin() + i, at.begin() + last, nullptr);
+                i = end - 1;
+                continue;
+            }
+            if (code[i].op == OP_VISIBLE) {
+                visible(out);
+                continue;
+            }
+            int passes = compactions;
+            Result r = this->execute(code[i]);
+            if (opts.counters || !countersOnly(r))
+                out << r;
+
+            unsigned int last = min(i + ahead, (unsigned int)code.size() - 1);
+            if (r.op == OP_END || r.op == OP_REMOVE || compactions != passes)
+                fill(at.begin() + i, at.begin() + last + 1, nullptr);
+            if (last == i)
+                continue;
+
+            // Spread a path of about 2 log2(n) nodes over the instructions
+            // ahead. The paths advance in turns so a prefetch has the other
+            // paths' steps to land before its node is read.
+            int level = occupied.empty() ? 0 : occupied.back();
+            int symbols = 0;
+            for (unsigned int k = 0; k < occupied.size(); k++)
+                symbols += level_size[occupied[k]];
+            int steps = 2 * log2(symbols + 2) / (ahead + 1) + 1;
+            for (int step = 0; step < steps; step++)
+                for (unsigned int j = i + 1; j <= last; j++)
+                    if (code[j].op == OP_INSERT || code[j].op == OP_ASSIGN ||
+                        code[j].op == OP_LOOKUP || code[j].op == OP_REMOVE)
+                        at[j] = prefetch(at[j], code[j].name, level, index);
+        }
+        if (chunk.invalid)
+            throw InvalidInstruction(chunk.line);
     }
 
     if (this->cur_level > 0) {
         throw UnclosedBlock(this->cur_level);
     }
 }
+
+template class BasicSymbolTable<SplayTree>;
+template class BasicSymbolTable<NameSplayTree>;
+template class BasicSymbolTable<AVLTree>;
+template class BasicSymbolTable<HashIndex>;
+template class BasicSymbolTable<BPlusTree>;
@@ -7,47 +7,651 @@ class Symbol {
     string name, para;
     int type;
     int level;
+    int height;
     Symbol *right, *left, *parent;
+    Symbol* next_in_level;
 
     int compare(Symbol*);
+    int compareByName(Symbol*);
 
   public:
     Symbol();
     Symbol(string, int, int, Symbol*);
+    static void* operator new(size_t);
+    static void operator delete(void*);
 
-    friend class SymbolTable;
+    friend class SplayTree;
+    friend class NameSplayTree;
+    friend class AVLTree;
+    friend class HashIndex;
+    friend class BPlusTree;
+    friend class ResolveCache;
+    friend class TypeCheck;
+    friend class FrozenTable;
+    friend class GlobalRegistry;
+    template <class Index> friend class BasicSymbolTable;
 };
 
-class SymbolTable {
+// Symbol nodes in a memory-mapped scratch file, for tables larger than
+// physical memory. Each Symbol object takes a slot of one reserved address
+// range that the file grows into, so the kernel writes the pages nobody
+// touches, typically those of outer scopes, back to the file instead of an
+// allocation failing. The nodes are ordinary Symbols, std::string members
+// included: a name or type of up to 15 characters sits in the short-string
+// buffer and so in the file, longer ones and compact() arrays stay on the
+// heap. The store is process-wide: the first table whose options name a
+// file opens it, and every Symbol allocated after that lives there. A table
+// cannot report a failed open, so main and the server open it up front.
+class SymbolStore {
   private:
+    static const size_t RESERVE = 1ULL << 40; // address space for the file
+    static const size_t GROW = 64 << 20;      // file growth step
+    static atomic<SymbolStore*> active;
+    int fd;
+    char* base;
+    size_t used, mapped;
+    void* free_slots; // linked through their first word
+    mutex lock;
+
+    SymbolStore(int, char*);
+
+  public:
+    static bool open(const string&);
+    static void* allocate(size_t);
+    static void release(void*);
+};
+
+enum Opcode {
+    OP_INSERT,
+    OP_ASSIGN,
+    OP_BEGIN,
+    OP_END,
+    OP_LOOKUP,
+    OP_PRINT,
+    OP_REMOVE,
+    OP_COMPLETE,
+    OP_VISIBLE
+};
+
+// One pre-parsed instruction. `value` holds the type text for INSERT and the
+// right-hand side for ASSIGN; `type` is the parsed INSERT type (see getType).
+struct Instruction {
+    Opcode op;
+    string name, value;
+    int type;
+    bool is_static;
+
+    Instruction(Opcode = OP_PRINT, string = "", string = "", int = -1,
+                bool = false);
+    string str() const;
+};
+
+// Outcome of one instruction: counters for INSERT/ASSIGN/REMOVE, the
+// resolved level for LOOKUP and the listing for PRINT, COMPLETE and VISIBLE.
+struct Result {
+    Opcode op;
+    int num_comp, num_splay;
+    int level;
+    string text;
+
+    Result(Opcode = OP_PRINT);
+};
+
+ostream &operator<<(ostream &, const Result &);
+bool countersOnly(const Result&); // prints nothing without counters
+
+enum SplayMode { SPLAY_FULL, SPLAY_SEMI, SPLAY_DEPTH, SPLAY_RANDOM };
+
+// Execution options. With counters off INSERT/ASSIGN print nothing and the
+// engines may trade the reference tree shape for speed. A field that can
+// change the output belongs in the result cache key, outputConfig() in
+// main.cpp.
+struct Options {
+    bool counters;
+    SplayMode splay_mode;
+    double splay_depth;       // SPLAY_DEPTH: splay below depth * log2(n)
+    double splay_probability; // SPLAY_RANDOM: chance of splaying an access
+    double rebalance_depth;   // rebuild the tree past depth * log2(n), 0: off
+    int filter_bits;          // log2 of the name filter size, 0: no filter
+    int cache_bits;           // log2 of the resolution cache size, 0: none
+    int lookahead;            // lines run() prefetches search paths for,
+                              // reference splay engine only
+    int threads;              // parser threads of run(), 0: parse inline
+    int speculate;            // threads checking top-level blocks, 0: off
+    int memo;                 // top-level block outcomes kept, 0: none
+    string profile_in;        // level-0 access counts to lay globals out by
+    string profile_out;       // file to record level-0 access counts in
+    int compact;              // updates between splay tree compactions
+    string store;             // file for the Symbol nodes, "": the heap
+
+    Options();
+    bool set(const string&); // apply one --option, false if unknown
+};
+
+// Index engines. Each one owns the Symbol nodes handed to insert() and
+// provides the per-level primitives the interpreter is written against:
+//   insert(s, comp, splay)      false if (name, level) already exists
+//   search(name, level, ...)    counted, possibly restructuring lookup
+//   lookup(name, level)         uncounted exact lookup (LOOKUP)
+//   peek(name, level)           lookup that never restructures the index
+//   remove(level, visit)        drop every symbol of the highest level,
+//                               calling visit(symbol) before freeing it
+//   erase(s)                    drop and free the single symbol s
+//   preorder()                  "name//level " listing for PRINT
+//   forEach(visit)              call visit(symbol) for every symbol
+//   compact()                   move the nodes together, keeping the shape
+//   configure(options)          pick up the execution options
+
+// Splay tree ordered by (level, name); its counters are the reference ones.
+// compact() moves every node into one array in preorder; nodes allocated
+// since stay on the heap and each node is freed wherever it lives.
+class SplayTree {
+  protected:
     Symbol* root;
-    int cur_level;
+    int size;
+    Symbol* pool; // array of the last compaction
+    int pool_size, pool_live;
+    SplayMode mode;
+    double depth_factor, probability, rebalance_depth;
+    unsigned int seed;
+    long long rotations, rebalances;
+    int max_depth;
 
     void clear(Symbol*);
+    void release(Symbol*);
     void right_rotate(Symbol*);
     void left_rotate(Symbol*);
     void remove(Symbol*);
-    void remove(int);
     int splay(Symbol*);
-    bool h_lookup(string, int);
+    int semiSplay(Symbol*);
+    int access(Symbol*, int);
+    bool degenerate(int);
+    void rebalance();
+    void compress(Symbol*, int);
+    void relink(Symbol*);
     string preorder(Symbol*);
-    Symbol* search(string, int&, int&);
+    static Symbol* build(const vector<Symbol*>&, size_t, size_t, Symbol*);
+    static Symbol* build(const vector<Symbol*>&, const vector<double>&,
+                         size_t, size_t, Symbol*);
+    void inorder(vector<Symbol*>&) const;
     Symbol* search_level(string, int, int&);
     Symbol* getMaxValueNode(Symbol* root);
     Symbol* bst_search(string, int);
 
   public:
-    SymbolTable();
-    ~SymbolTable();
+    SplayTree();
+    ~SplayTree();
+    void configure(const Options&);
+    long long getRotations() const;
+    long long getRebalances() const;
+    int getMaxDepth() const;
+    bool insert(Symbol*, int&, int&);
+    Symbol* search(string, int, int&, int&);
+    Symbol* lookup(string, int);
+    Symbol* peek(string, int) const;
+    void lookupAll(int, const vector<string>&, vector<Symbol*>&);
+    void insertAll(const vector<Symbol*>&);
+    template <class Weight> void reshape(Weight);
+    template <class Weight> double expectedDepth(Weight) const;
+    void erase(Symbol*);
+    void compact();
+    Symbol* prefetch(Symbol*, const string&, int);
+    template <class Visit> void remove(int, Visit);
+    template <class Visit> void forEach(Visit) const;
+    string preorder();
+};
+
+// Splay tree ordered by (name, level). The innermost visible declaration of
+// a name is the predecessor of (name, cur_level), so resolve() finds it in a
+// single descent however deep the nesting is. Scope exit walks a per-level
+// list of the level's nodes. PRINT is the preorder of this tree, so it lists
+// the same symbols as the reference engine in a different order. compact()
+// would not relink the level lists, so the table never compacts this one.
+class NameSplayTree : public SplayTree {
+  private:
+    vector<Symbol*> level_head;
+
+    Symbol* find(string, int, int&);
+
+  public:
+    bool insert(Symbol*, int&, int&);
+    Symbol* search(string, int, int&, int&);
+    Symbol* lookup(string, int);
+    Symbol* peek(string, int);
+    Symbol* resolve(string, int, int&, int&);
+    void erase(Symbol*);
+    template <class Visit> void remove(int, Visit);
+};
+
+// AVL tree with the same (level, name) order; never splays.
+class AVLTree {
+  private:
+    Symbol* root;
+
+    void clear(Symbol*);
+    int height(Symbol*);
+    void update(Symbol*);
+    Symbol* right_rotate(Symbol*);
+    Symbol* left_rotate(Symbol*);
+    Symbol* balance(Symbol*);
+    Symbol* insert(Symbol*, Symbol*, int&, bool&);
+    Symbol* removeMax(Symbol*, Symbol*&);
+    Symbol* erase(Symbol*, Symbol*);
+    string preorder(Symbol*);
+    Symbol* find(string, int, int&);
+
+  public:
+    AVLTree();
+    ~AVLTree();
+    void configure(const Options&);
+    bool insert(Symbol*, int&, int&);
+    Symbol* search(string, int, int&, int&);
+    Symbol* lookup(string, int);
+    Symbol* peek(string, int);
+    void erase(Symbol*);
+    template <class Visit> void remove(int, Visit);
+    template <class Visit> void forEach(Visit) const;
+    string preorder();
+};
+
+// Hash map from name to its declaration stack, plus the symbols of each
+// level for scope exit. PRINT lists by (level, name) as there is no tree.
+class HashIndex {
+  private:
+    unordered_map<string, vector<Symbol*> > names;
+    vector<vector<Symbol*> > levels;
+
+    static bool byName(Symbol*, Symbol*);
+    Symbol* find(string, int, int&);
+
+  public:
+    ~HashIndex();
+    void configure(const Options&);
+    bool insert(Symbol*, int&, int&);
+    Symbol* search(string, int, int&, int&);
+    Symbol* lookup(string, int);
+    Symbol* peek(string, int);
+    void erase(Symbol*);
+    template <class Visit> void remove(int, Visit);
+    template <class Visit> void forEach(Visit) const;
+    string preorder();
+};
+
+// B+-tree over (level, name). Every node keeps the level and the first eight
+// name bytes of its keys in flat arrays, so a node is searched with one
+// branch-free scan the compiler can vectorize; full names only break ties.
+// Inner separators are private copies of the key, leaves point at symbols
+// and are chained in order. END truncates the tail of the key space and may
+// leave the nodes along its edge underfull; erase keeps the nodes on its
+// path at least half full by borrowing from or merging with a sibling.
+class BPlusTree {
+  private:
+    static const int FANOUT = 32;
+
+    struct Node {
+        bool leaf;
+        int size;
+        int level[FANOUT + 1];
+        unsigned long long prefix[FANOUT + 1];
+        Symbol* key[FANOUT + 1];
+        Node* child[FANOUT + 2];
+        Node* next;
+
+        Node(bool);
+    };
+
+    Node* root;
+
+    static unsigned long long pack(const string&);
+    static void place(Node*, int, Symbol*, unsigned long long);
+    static void copy(Node*, int, Node*, int);
+    void clear(Node*);
+    int rank(Node*, int, unsigned long long, const string&, bool);
+    static Symbol* separator(Node*);
+    Node* insert(Node*, Symbol*, int&, bool&, Symbol*&);
+    bool erase(Node*, Symbol*, unsigned long long);
+    void refill(Node*, int);
+    bool truncate(Node*, int);
+    Symbol* find(string, int, int&);
+
+  public:
+    BPlusTree();
+    ~BPlusTree();
+    void configure(const Options&);
+    bool insert(Symbol*, int&, int&);
+    Symbol* search(string, int, int&, int&);
+    Symbol* lookup(string, int);
+    Symbol* peek(string, int);
+    void erase(Symbol*);
+    template <class Visit> void remove(int, Visit);
+    template <class Visit> void forEach(Visit) const;
+    string preorder();
+};
+
+// Counting Bloom filter over the names declared at any visible level. A
+// negative answer proves a name undeclared without touching the index;
+// saturated counters are never decremented so there are no false negatives.
+class NameFilter {
+  private:
+    static const int HASHES = 3;
+    vector<unsigned char> counts;
+    unsigned long long mask;
+    long long queries, rejected, false_positives;
+
+  public:
+    NameFilter();
+    void resize(int);
+    bool enabled() const;
+    void add(const string&);
+    void remove(const string&);
+    bool mayContain(const string&);
+    void missed();
+    void printStats(ostream&) const;
+};
+
+// Direct-mapped cache from a name to the symbol it last resolved to, used
+// without counters since a hit skips the splay. Every entry records the
+// epoch of its symbol's level: END bumps that epoch, and an INSERT of the
+// name clears its slot since the new symbol may shadow the cached one.
+class ResolveCache {
+  private:
+    struct Entry {
+        Symbol* symbol;
+        int level;
+        unsigned int epoch;
+    };
+    vector<Entry> slots;
+    vector<unsigned int> epochs;
+    unsigned long long mask;
+    long long hits, misses;
+
+  public:
+    ResolveCache();
+    void resize(int);
+    bool enabled() const;
+    Symbol* get(const string&);
+    void put(const string&, Symbol*);
+    void forget(const string&);
+    void expire(int);
+    void printStats(ostream&) const;
+};
+
+// Path-compressed radix trie over the declared names, kept beside the index
+// for prefix queries. The node a name ends at holds its declarations as a
+// stack, innermost last. A node whose stack empties is pruned, or merged
+// with its only child, so every node under a prefix leads to a declared
+// name and a completion costs O(|prefix| + results).
+class NameTrie {
+  private:
+    struct Decl {
+        int level;
+        string type; // as declared, see BasicSymbolTable::typeName
+    };
+    struct Node {
+        string label; // characters on the edge from the parent
+        vector<Decl> decls;
+        vector<Node*> children; // by first character
+    };
+    Node root;
+
+    static Node* child(const Node*, char);
+    static void merge(Node*);
+    static void clear(Node*);
+    template <class Visit> static void walk(const Node*, string&, Visit);
+
+  public:
+    ~NameTrie();
+    void insert(const string&, int, const string&);
+    void erase(const string&, int);
+    template <class Visit> void complete(const string&, Visit) const;
+};
+
+// Front end of run(): splits a script into chunks of whole lines and parses
+// them into instructions, on worker threads when there are any. Chunk c is
+// parsed by worker c % threads and handed over through that worker's
+// bounded single-producer ring, so chunks come out in script order. A chunk
+// stops at its first invalid line.
+class FrontEnd {
+  public:
+    struct Chunk {
+        vector<Instruction> code;
+        bool invalid; // the line after `code` does not parse...
+        string line;  // ...and this is it
+    };
+
+  private:
+    static const size_t CHUNK = 1 << 16; // bytes per chunk, about
+    static const unsigned int RING = 4;  // chunks in flight per worker
+
+    struct Ring {
+        Chunk slots[RING];
+        atomic<unsigned int> head, tail;
+    };
+
+    string text;
+    vector<size_t> bounds; // chunk c is [bounds[c], bounds[c + 1])
+    Instruction (*parse)(string);
+    int threads;
+    vector<thread> workers;
+    Ring* rings;
+    atomic<bool> stop;
+    size_t next;
+
+    void split();
+    void parseChunk(size_t, Chunk&);
+    void work(int);
+
+  public:
+    FrontEnd(istream&, Instruction (*)(string), int);
+    ~FrontEnd();
+    bool pop(Chunk&);
+};
+
+unsigned long long hashString(const string&);
+template <class T, class Less> void parallelSort(vector<T>&, Less, int);
+
+// Type rules of INSERT types and ASSIGN, shared by the table and its frozen
+// snapshots. They are written against a resolver R providing
+//   find(name)       the visible symbol of that name, or null
+//   expect(names)    the sorted, distinct names about to be found, which R
+//                    may resolve together as one batch
+class TypeCheck {
+  public:
+    static int getType(string);
+    template <class R> static string paraTypes(string, R&);
+    template <class R> static void assign(const Instruction&, R&);
+};
+
+// Immutable snapshot of the symbols visible when it was taken, innermost
+// declaration per name, stored by name in Eytzinger order: the node of
+// index k has its children at 2k and 2k + 1, so a search reads one array
+// front to back. Queries never modify it and are safe from any number of
+// threads; errors are thrown as by the table.
+class FrozenTable {
+  private:
+    vector<string> keys; // keys[1..n], Eytzinger order
+    vector<Symbol> symbols;
+
+    struct Resolver {
+        const FrozenTable* table;
+        const Symbol* find(const string&) const;
+        void expect(const vector<string>&) const {}
+    };
+
+    static bool innermostFirst(Symbol*, Symbol*);
+    void build(const vector<Symbol*>&, size_t&, size_t);
+
+  public:
+    FrozenTable(vector<Symbol*>);
+    int size() const;
+    const Symbol* find(const string&) const;
+    Result resolve(string) const;
+    Result checkAssign(string, string) const;
+};
+
+// Static symbols shared by the tables of any number of sessions. The name
+// index is an immutable list of sorted runs of decreasing size behind an
+// atomic pointer; a reader announces itself on one of two counters, picked
+// by the parity of the epoch, and never blocks. Writers are serialized:
+// each publishes a new list in which the new symbol and the smaller runs
+// are merged as in a binary counter, so a declaration copies O(log n)
+// symbols amortized. It then flips the epoch and frees what it replaced
+// once the counter of the old parity drains. Symbols live as long as the
+// registry, so pointers handed out stay valid.
+class GlobalRegistry {
+  private:
+    typedef vector<const vector<Symbol*>*> Runs;
+
+    atomic<const Runs*> current;
+    atomic<unsigned int> epoch;
+    atomic<long> readers[2];
+    mutex writer;
+
+    static bool byName(Symbol*, const string&);
+    static bool ordered(Symbol*, Symbol*);
+    static Symbol* find(const Runs*, const string&);
+    unsigned int enter();
+    void leave(unsigned int);
+
+  public:
+    GlobalRegistry();
+    ~GlobalRegistry();
+    Symbol* declare(Symbol*);
+    Symbol* find(const string&);
+    vector<Symbol*> complete(const string&);
+    template <class Visit> void forEach(Visit);
+    int size();
+};
+
+template <class Index> class BasicSymbolTable {
+  private:
+    Index index;
+    int cur_level;
+    Options opts;
+    vector<int> level_size; // symbols declared per level
+    vector<int> occupied;   // levels with symbols, ascending
+    NameFilter filter;
+    ResolveCache cache;
+    GlobalRegistry* globals; // holds static symbols instead of the index
+    unordered_set<string> shared; // statics this session put in globals
+    const FrozenTable* base; // globals seen by a speculative block
+
+    // Printed results and error of a top-level block
+    struct Outcome {
+        vector<Result> results;
+        exception_ptr error;
+        bool recent; // replayed since the clock hand last passed
+
+        Outcome() : recent(false) {}
+    };
+    unordered_map<string, Outcome> memo; // by memoKey()
+    vector<string> memo_clock;            // its keys, evicted by CLOCK
+    size_t memo_hand;
+    long long memo_hits, memo_misses;
+    unordered_map<string, long long> accesses; // recorded for profile_out
+    unordered_map<string, double> weights;     // read from profile_in
+    bool unsettled;                            // globals await the layout
+    int laid_out;                              // globals in the last layout
+    double depth_before, depth_after;          // its expected depths
+    long long churn;                           // updates since compact()
+    int compactions;
+    NameTrie trie;                             // of every symbol if indexed
+    bool indexed;                              // set by the first COMPLETE
+
+    void occupy(int);
+    void dropped(Symbol*);
+    Symbol* touch(Symbol*);
+    void settle();
+    template <class I> void settle(I&);
+    void settle(SplayTree&);
+    void compactIfDue();
+    template <class I> void compact(I&);
+    void compact(SplayTree&);
+    static size_t blockEnd(const vector<Instruction>&, size_t);
+    static bool independent(const vector<Instruction>&, size_t, size_t);
+    static void identifiers(const string&, vector<string>&);
+    static string typeName(Symbol*);
+    string memoKey(const vector<Instruction>&, size_t, size_t);
+    void remember(const string&, const Outcome&);
+    void check(const vector<Instruction>&, size_t, size_t, Outcome&);
+    void runBlocks(const vector<Instruction>&, ostream&);
+    Symbol* global(const string&);
+    Symbol* search(string, int&, int&);
+    template <class I> Symbol* search(string, int&, int&, I&);
+    Symbol* search(string, int&, int&, NameSplayTree&);
+    template <class I> Symbol* lookup(string, I&);
+    Symbol* lookup(string, NameSplayTree&);
+    void resolveAll(const vector<string>&, vector<Symbol*>&);
+    template <class I>
+    void resolveAll(const vector<string>&, vector<Symbol*>&, I&);
+    void resolveAll(const vector<string>&, vector<Symbol*>&, SplayTree&);
+    template <class I> static int lookahead(const Options&, I&);
+    static int lookahead(const Options&, SplayTree&);
+    template <class I> Symbol* prefetch(Symbol*, const string&, int, I&);
+    Symbol* prefetch(Symbol*, const string&, int, SplayTree&);
+    size_t insertRun(const vector<Instruction>&, size_t);
+    void insertAll(const vector<Instruction>&, size_t, size_t);
+    template <class I>
+    void insertAll(const vector<Instruction>&, size_t, size_t, I&);
+    void insertAll(const vector<Instruction>&, size_t, size_t, SplayTree&);
+
+    // TypeCheck resolver over the live table; without counters the
+    // expected names are resolved as one batch
+    struct Resolver {
+        BasicSymbolTable* table;
+        int &num_comp, &num_splay;
+        vector<string> names;
+        vector<Symbol*> found;
+
+        Symbol* find(const string&);
+        void expect(const vector<string>&);
+    };
+
+    // Accesses a global is expected to get by the profile
+    struct Weight {
+        const unordered_map<string, double>* weights;
+        double operator()(Symbol*) const;
+    };
+
+    Result insert(const Instruction&);
+    Result assign(const Instruction&);
+    Result lookup(const Instruction&);
+    Result remove(const Instruction&);
+    void buildTrie();
+    Result complete(const Instruction&);
+    template <class Visit> void forNames(const string&, Visit);
+    template <class Visit> void forVisible(Visit);
+
+  public:
+    BasicSymbolTable(const Options& = Options(), GlobalRegistry* = nullptr);
+    ~BasicSymbolTable();
     void run(string filename);
-    int getType(string);
+    void run(istream&, ostream&);
+    void reset();
+    void compact();
+    const Index& getIndex() const;
+    void printStats(ostream&) const;
+    static Instruction parse(string line);
+    static int getType(string);
     string getParaType(string, int&, int&);
     int getValueType(string);
-    void insert(smatch);
-    void assign(smatch);
-    void begin();
-    void end();
-    void lookup(smatch);
-    void print();
+
+    // Typed entry points; errors are thrown as in run()
+    Result declare(string name, int type, string para, bool is_static);
+    vector<Result> declareAll(const vector<Instruction>&);
+    Result resolve(string name);
+    Result undeclare(string name);
+    Result checkAssign(string name, string value);
+    void enterScope();
+    void exitScope();
+    Result print();
+    Result complete(string prefix);
+    Result visible();
+    void visible(ostream&);
+    FrozenTable freeze() const;
+    Result execute(const Instruction&);
+    vector<Result> execute(const vector<Instruction>&);
 };
+
+typedef BasicSymbolTable<SplayTree> SymbolTable;
 #endif
@@ -0,0 +1,649 @@
+#include "SymbolTable.cpp"
+#include "SymbolTable.h"
+#include <chrono>
+#include <linux/perf_event.h>
+#include <random>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using namespace std;
+
+// Benchmarks for the index engines, built the same way as main.cpp:
+//   g++ -O2 -o bench bench.cpp
+//   ./bench engines [symbols...]
+//   ./bench splay [symbols...]
+//   ./bench degenerate [symbols...]
+//   ./bench cache [symbols...]
+//   ./bench lookahead [symbols...]
+//   ./bench frozen [symbols...]
+//   ./bench registry [symbols...]
+//   ./bench bulk [symbols...]
+//   ./bench profile [symbols...]
+//   ./bench compact [symbols...]
+//   ./bench complete [symbols...]
+//   ./bench visible [symbols...]
+
+double seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start)
+        .count();
+}
+
+vector<string> makeNames(int n, unsigned int seed) {
+    mt19937_64 rng(seed);
+    vector<string> names(n);
+    char buf[32];
+    for (int i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "v%08llx%x",
+                 (unsigned long long)(rng() & 0xffffffffULL), i);
+        names[i] = buf;
+    }
+    return names;
+}
+
+// Declare every name as a global, resolve n random ones, then open a scope,
+// fill it with a tenth as many locals and close it again
+template <class Index>
+void benchEngine(string engine, const vector<string> &names) {
+    BasicSymbolTable<Index> *st = new BasicSymbolTable<Index>();
+    int n = names.size();
+    mt19937 rng(1);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+        st->declare(names[i], 0, "", false);
+    double insert = seconds(start);
+
+    start = chrono::steady_clock::now();
+    long long levels = 0;
+    for (int i = 0; i < n; i++)
+        levels += st->resolve(names[rng() % n]).level;
+    double lookup = seconds(start);
+
+    st->enterScope();
+    for (int i = 0; i < n / 10; i++)
+        st->declare(names[i], 1, "", false);
+    start = chrono::steady_clock::now();
+    st->exitScope();
+    double end = seconds(start);
+
+    cout << engine << "\t" << n << "\t" << insert << "\t" << lookup << "\t"
+         << end << endl;
+    delete st;
+}
+
+void benchEngines(vector<int> sizes) {
+    cout << "engine\tsymbols\tinsert_s\tlookup_s\tend_s" << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        vector<string> names = makeNames(sizes[i], 42);
+        benchEngine<SplayTree>("splay", names);
+        benchEngine<NameSplayTree>("name", names);
+        benchEngine<BPlusTree>("bplus", names);
+    }
+}
+
+// Read-heavy workload with a skewed choice of names, once per access mode
+void benchSplayMode(string mode_name, SplayMode mode,
+                    const vector<string> &names) {
+    Options opts;
+    opts.counters = false;
+    opts.splay_mode = mode;
+    SymbolTable *st = new SymbolTable(opts);
+    int n = names.size();
+    for (int i = 0; i < n; i++)
+        st->declare(names[i], 0, "", false);
+
+    mt19937 rng(1);
+    uniform_real_distribution<double> u(0, 1);
+    long long before = st->getIndex().getRotations();
+    int lookups = 4 * n;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < lookups; i++) {
+        double x = u(rng);
+        st->resolve(names[(int)(x * x * x * x * n)]);
+    }
+    double elapsed = seconds(start);
+
+    cout << mode_name << "\t" << n << "\t" << lookups / elapsed << "\t"
+         << (st->getIndex().getRotations() - before) / (double)lookups
+         << endl;
+    delete st;
+}
+
+void benchSplay(vector<int> sizes) {
+    cout << "mode\tsymbols\tlookups_per_s\trotations_per_lookup" << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        vector<string> names = makeNames(sizes[i], 42);
+        benchSplayMode("full", SPLAY_FULL, names);
+        benchSplayMode("semi", SPLAY_SEMI, names);
+        benchSplayMode("depth", SPLAY_DEPTH, names);
+        benchSplayMode("random", SPLAY_RANDOM, names);
+    }
+}
+
+double percentile(vector<double> &v, double p) {
+    unsigned int i = (unsigned int)(p * (v.size() - 1));
+    nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+// Sorted declarations turn the splay tree into a chain; report the
+// per-instruction latency tail of the declarations and the random lookups
+// that follow, with and without the rebalancing guard
+void benchDegenerate(string name, double guard, vector<string> names) {
+    Options opts;
+    opts.counters = false;
+    opts.rebalance_depth = guard;
+    SymbolTable *st = new SymbolTable(opts);
+    int n = names.size();
+    sort(names.begin(), names.end());
+
+    vector<double> latency;
+    latency.reserve(2 * n);
+    for (int i = 0; i < n; i++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        st->declare(names[i], 0, "", false);
+        latency.push_back(seconds(start));
+    }
+    mt19937 rng(1);
+    for (int i = 0; i < n; i++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        st->resolve(names[rng() % n]);
+        latency.push_back(seconds(start));
+    }
+
+    cout << name << "\t" << n << "\t" << percentile(latency, 0.5) * 1e6
+         << "\t" << percentile(latency, 0.99) * 1e6 << "\t"
+         << percentile(latency, 0.999) * 1e6 << "\t"
+         << *max_element(latency.begin(), latency.end()) * 1e6 << "\t"
+         << st->getIndex().getMaxDepth() << "\t"
+         << st->getIndex().getRebalances() << endl;
+    delete st;
+}
+
+void benchDegenerates(vector<int> sizes) {
+    cout << "guard\tsymbols\tp50_us\tp99_us\tp999_us\tmax_us\tmax_depth"
+            "\trebalances"
+         << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        vector<string> names = makeNames(sizes[i], 42);
+        benchDegenerate("off", 0, names);
+        benchDegenerate("3log", 3, names);
+    }
+}
+
+// ASSIGN-heavy workload: a few hot variables nested several scopes below
+// the globals are assigned each other over and over
+void benchCache(string name, int bits, const vector<string> &names) {
+    Options opts;
+    opts.counters = false;
+    opts.cache_bits = bits;
+    SymbolTable *st = new SymbolTable(opts);
+    int n = names.size();
+    for (int i = 0; i < n; i++)
+        st->declare(names[i], 0, "", false);
+    for (int i = 0; i < 8; i++)
+        st->enterScope();
+    int hot = 64 < n ? 64 : n;
+    for (int i = 0; i < hot; i++)
+        st->declare(names[i], 0, "", false);
+
+    mt19937 rng(1);
+    int assigns = 4 * n;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < assigns; i++)
+        st->checkAssign(names[rng() % hot], names[rng() % hot]);
+    double elapsed = seconds(start);
+
+    cout << name << "\t" << n << "\t" << assigns / elapsed << endl;
+    st->printStats(cerr);
+    for (int i = 0; i < 8; i++)
+        st->exitScope();
+    delete st;
+}
+
+void benchCaches(vector<int> sizes) {
+    cout << "cache\tsymbols\tassigns_per_s" << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        vector<string> names = makeNames(sizes[i], 42);
+        benchCache("off", 0, names);
+        benchCache("1024", 10, names);
+    }
+}
+
+// Script of n global declarations followed by 4n LOOKUPs of random names,
+// run with and without prefetching the next lines' search paths. Pick n so
+// the table is well past the last level cache.
+void benchLookahead(string name, int lookahead, string script, int n) {
+    Options opts;
+    opts.counters = false;
+    opts.lookahead = lookahead;
+    SymbolTable *st = new SymbolTable(opts);
+    ofstream null;
+    streambuf *out = cout.rdbuf(null.rdbuf());
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    st->run(script);
+    double elapsed = seconds(start);
+    cout.rdbuf(out);
+    cout << name << "\t" << n << "\t" << elapsed << endl;
+    delete st;
+}
+
+void benchLookaheads(vector<int> sizes) {
+    cout << "lookahead\tsymbols\trun_s" << endl;
+    string script = "bench_lookahead.tmp";
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        int n = sizes[i];
+        vector<string> names = makeNames(n, 42);
+        ofstream file(script);
+        for (int j = 0; j < n; j++)
+            file << "INSERT " << names[j] << " number false\n";
+        mt19937 rng(1);
+        for (int j = 0; j < 4 * n; j++)
+            file << "LOOKUP " << names[rng() % n] << "\n";
+        file.close();
+
+        benchLookahead("off", 0, script, n);
+        benchLookahead("4", 4, script, n);
+        benchLookahead("16", 16, script, n);
+    }
+    remove(script.c_str());
+}
+
+// Lookups on one frozen snapshot from 1, 2, 4 and 8 threads at once
+void benchFrozen(vector<int> sizes) {
+    cout << "threads\tsymbols\tlookups_per_s" << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        int n = sizes[i];
+        vector<string> names = makeNames(n, 42);
+        SymbolTable *st = new SymbolTable();
+        for (int j = 0; j < n; j++)
+            st->declare(names[j], 0, "", false);
+        FrozenTable frozen = st->freeze();
+        delete st;
+
+        for (int threads = 1; threads <= 8; threads *= 2) {
+            vector<thread> workers;
+            vector<long long> levels(threads);
+            chrono::steady_clock::time_point start =
+                chrono::steady_clock::now();
+            for (int t = 0; t < threads; t++)
+                workers.push_back(thread([&, t]() {
+                    mt19937 rng(t);
+                    for (int j = 0; j < n; j++)
+                        levels[t] += frozen.resolve(names[rng() % n]).level;
+                }));
+            for (int t = 0; t < threads; t++)
+                workers[t].join();
+            double elapsed = seconds(start);
+            cout << threads << "\t" << n << "\t"
+                 << (double)threads * n / elapsed << endl;
+        }
+    }
+}
+
+// Sessions on 4 threads resolve the globals of one shared registry, each
+// inside a scope of its own locals, while the main thread keeps declaring
+// new globals or not
+void benchRegistry(vector<int> sizes) {
+    cout << "writer\tsymbols\tresolves_per_s\tglobals_added" << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        int n = sizes[i];
+        vector<string> names = makeNames(2 * n, 42);
+        for (int writing = 0; writing < 2; writing++) {
+            GlobalRegistry registry;
+            Options opts;
+            opts.counters = false;
+            SymbolTable *loader = new SymbolTable(opts, &registry);
+            for (int j = 0; j < n; j++)
+                loader->declare(names[j], 0, "", true);
+
+            atomic<int> finished(0);
+            vector<thread> sessions;
+            chrono::steady_clock::time_point start =
+                chrono::steady_clock::now();
+            for (int t = 0; t < 4; t++)
+                sessions.push_back(thread([&, t]() {
+                    SymbolTable *st = new SymbolTable(opts, &registry);
+                    st->enterScope();
+                    for (int j = 0; j < 100; j++)
+                        st->declare(names[j], 1, "", false);
+                    mt19937 rng(t);
+                    for (int j = 0; j < n; j++)
+                        st->resolve(names[rng() % n]);
+                    st->exitScope();
+                    delete st;
+                    finished++;
+                }));
+            int added = 0;
+            while (writing && finished < 4 && added < n) {
+                loader->declare(names[n + added++], 1, "", true);
+                this_thread::sleep_for(chrono::microseconds(100));
+            }
+            for (int t = 0; t < 4; t++)
+                sessions[t].join();
+            double elapsed = seconds(start);
+            cout << (writing ? "on" : "off") << "\t" << n << "\t"
+                 << 4.0 * n / elapsed << "\t" << added << endl;
+            delete loader;
+        }
+    }
+}
+
+// n global declarations loaded one by one or as one batch, the latter with
+// the sort on 1 and 4 threads, then n lookups of random names
+void benchBulk(string name, int threads, const vector<Instruction> &batch) {
+    Options opts;
+    opts.counters = false;
+    opts.threads = threads;
+    SymbolTable *st = new SymbolTable(opts);
+    int n = batch.size();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (name == "single")
+        for (int i = 0; i < n; i++)
+            st->execute(batch[i]);
+    else
+        st->declareAll(batch);
+    double load = seconds(start);
+
+    mt19937 rng(1);
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+        st->resolve(batch[rng() % n].name);
+    double lookup = seconds(start);
+
+    cout << name << "\t" << n << "\t" << load << "\t" << lookup << endl;
+    delete st;
+}
+
+void benchBulks(vector<int> sizes) {
+    cout << "load\tsymbols\tload_s\tlookup_s" << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        vector<string> names = makeNames(sizes[i], 42);
+        vector<Instruction> batch;
+        for (unsigned int j = 0; j < names.size(); j++)
+            batch.push_back(
+                Instruction(OP_INSERT, names[j], "number", 0, true));
+        benchBulk("single", 0, batch);
+        benchBulk("batch", 0, batch);
+        benchBulk("batch4", 4, batch);
+    }
+}
+
+// Skewed lookups of n bulk loaded globals, as loaded or laid out by the
+// profile a recording run of the same workload wrote
+void benchProfile(string mode_name, SplayMode mode, string profile,
+                  const vector<Instruction> &batch, const vector<int> &hits) {
+    Options opts;
+    opts.counters = false;
+    opts.splay_mode = mode;
+    opts.profile_in = profile;
+    SymbolTable *st = new SymbolTable(opts);
+    st->declareAll(batch);
+    st->resolve(batch[0].name); // the layout happens on the first access
+
+    long long before = st->getIndex().getRotations();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < hits.size(); i++)
+        st->resolve(batch[hits[i]].name);
+    double elapsed = seconds(start);
+
+    cout << mode_name << "\t" << (profile.empty() ? "off" : "on") << "\t"
+         << batch.size() << "\t" << hits.size() / elapsed << "\t"
+         << (st->getIndex().getRotations() - before) / (double)hits.size()
+         << endl;
+    st->printStats(cerr);
+    delete st;
+}
+
+void benchProfiles(vector<int> sizes) {
+    cout << "mode\tprofile\tsymbols\tlookups_per_s\trotations_per_lookup"
+         << endl;
+    string profile = "bench_profile.tmp";
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        int n = sizes[i];
+        vector<string> names = makeNames(n, 42);
+        vector<Instruction> batch;
+        for (int j = 0; j < n; j++)
+            batch.push_back(Instruction(OP_INSERT, names[j], "number", 0));
+        mt19937 rng(1);
+        uniform_real_distribution<double> u(0, 1);
+        vector<int> hits(4 * n);
+        for (int j = 0; j < 4 * n; j++) {
+            double x = u(rng);
+            hits[j] = (int)(x * x * x * x * n);
+        }
+
+        Options opts;
+        opts.counters = false;
+        opts.profile_out = profile;
+        SymbolTable *recorder = new SymbolTable(opts);
+        recorder->declareAll(batch);
+        for (int j = 0; j < 4 * n; j++)
+            recorder->resolve(names[hits[j]]);
+        delete recorder;
+
+        benchProfile("full", SPLAY_FULL, "", batch, hits);
+        benchProfile("full", SPLAY_FULL, profile, batch, hits);
+        benchProfile("depth", SPLAY_DEPTH, "", batch, hits);
+        benchProfile("depth", SPLAY_DEPTH, profile, batch, hits);
+    }
+    remove(profile.c_str());
+}
+
+// Last-level cache misses of the calling thread, counted by the kernel. The
+// counter is -1 where perf events are not allowed, as in most containers,
+// and the benchmarks then report time alone.
+int openMisses() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long readMisses(int fd) {
+    long long count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+// Uniform lookups of n globals after as many removes and redeclarations
+// have scattered their nodes, then the same lookups once compacted
+void benchCompact(string mode_name, SplayMode mode, const vector<string> &names,
+                  int misses) {
+    Options opts;
+    opts.counters = false;
+    opts.splay_mode = mode;
+    SymbolTable *st = new SymbolTable(opts);
+    int n = names.size();
+    mt19937 rng(1);
+    for (int i = 0; i < n; i++)
+        st->declare(names[i], 0, "", false);
+    for (int i = 0; i < n; i++) {
+        string name = names[rng() % n];
+        st->undeclare(name);
+        st->declare(name, 0, "", false);
+    }
+    vector<int> hits(4 * n);
+    for (int i = 0; i < 4 * n; i++)
+        hits[i] = rng() % n;
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1)
+            st->compact();
+        ioctl(misses, PERF_EVENT_IOC_RESET, 0);
+        ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < 4 * n; i++)
+            st->resolve(names[hits[i]]);
+        double elapsed = seconds(start);
+        ioctl(misses, PERF_EVENT_IOC_DISABLE, 0);
+        long long count = readMisses(misses);
+
+        cout << mode_name << "\t" << (pass ? "compacted" : "scattered") << "\t"
+             << n << "\t" << elapsed / hits.size() * 1e9 << "\t";
+        if (count < 0)
+            cout << "-" << endl;
+        else
+            cout << count / (double)hits.size() << endl;
+    }
+    delete st;
+}
+
+void benchCompacts(vector<int> sizes) {
+    int misses = openMisses();
+    if (misses < 0)
+        cerr << "no perf events, LLC misses not counted" << endl;
+    cout << "mode\tnodes\tsymbols\tns_per_lookup\tllc_misses_per_lookup"
+         << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        vector<string> names = makeNames(sizes[i], 42);
+        benchCompact("full", SPLAY_FULL, names, misses);
+        benchCompact("depth", SPLAY_DEPTH, names, misses);
+    }
+    if (misses >= 0)
+        close(misses);
+}
+
+// Completions of random prefixes of n globals against PRINT, a walk of the
+// whole index, which is what the (level, name) order leaves without a trie
+void benchComplete(vector<int> sizes) {
+    cout << "symbols\tprefix\tresults\ttrie_us\tprint_us" << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        int n = sizes[i];
+        vector<string> names = makeNames(n, 42);
+        SymbolTable *st = new SymbolTable();
+        for (int j = 0; j < n; j++)
+            st->declare(names[j], 0, "", false);
+        st->complete("v"); // builds the trie
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        st->print();
+        double print = seconds(start);
+
+        mt19937 rng(1);
+        for (int length = 2; length <= 6; length += 2) {
+            int queries = 1000;
+            long long results = 0;
+            start = chrono::steady_clock::now();
+            for (int j = 0; j < queries; j++) {
+                string text =
+                    st->complete(names[rng() % n].substr(0, length)).text;
+                results += count(text.begin(), text.end(), ' ') + 1;
+            }
+            double trie = seconds(start);
+
+            cout << n << "\t" << length << "\t" << results / (double)queries
+                 << "\t" << trie / queries * 1e6 << "\t" << print * 1e6
+                 << endl;
+        }
+        delete st;
+    }
+}
+
+// The visible environment of n globals, a tenth of them shadowed in each of
+// four scopes: VISIBLE against a LOOKUP of every name
+void benchVisible(vector<int> sizes) {
+    cout << "symbols\tvisible_ms\tlookups_ms" << endl;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        int n = sizes[i];
+        vector<string> names = makeNames(n, 42);
+        SymbolTable *st = new SymbolTable();
+        for (int j = 0; j < n; j++)
+            st->declare(names[j], 0, "", false);
+        for (int level = 1; level <= 4; level++) {
+            st->enterScope();
+            for (int j = level; j < n; j += 10)
+                st->declare(names[j], 1, "", false);
+        }
+        st->visible(); // builds the trie
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        Result listing = st->visible();
+        double visible = seconds(start);
+
+        start = chrono::steady_clock::now();
+        long long levels = 0;
+        for (int j = 0; j < n; j++)
+            levels += st->resolve(names[j]).level;
+        double lookups = seconds(start);
+
+        cout << n << "\t" << visible * 1e3 << "\t" << lookups * 1e3 << endl;
+        delete st;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cout << "usage: bench engines|splay|degenerate|cache|lookahead|frozen|"
+                "registry|bulk|profile|compact|complete|visible "
+                "[symbols...]"
+             << endl;
+        return 1;
+    }
+
+    string mode = argv[1];
+    vector<int> sizes;
+    for (int i = 2; i < argc; i++)
+        sizes.push_back(atoi(argv[i]));
+
+    if (mode == "engines") {
+        if (sizes.empty())
+            sizes.push_back(1000000);
+        benchEngines(sizes);
+    } else if (mode == "splay") {
+        if (sizes.empty())
+            sizes.push_back(100000);
+        benchSplay(sizes);
+    } else if (mode == "degenerate") {
+        if (sizes.empty())
+            sizes.push_back(100000);
+        benchDegenerates(sizes);
+    } else if (mode == "cache") {
+        if (sizes.empty())
+            sizes.push_back(100000);
+        benchCaches(sizes);
+    } else if (mode == "lookahead") {
+        if (sizes.empty())
+            sizes.push_back(1000000);
+        benchLookaheads(sizes);
+    } else if (mode == "frozen") {
+        if (sizes.empty())
+            sizes.push_back(1000000);
+        benchFrozen(sizes);
+    } else if (mode == "registry") {
+        if (sizes.empty())
+            sizes.push_back(100000);
+        benchRegistry(sizes);
+    } else if (mode == "bulk") {
+        if (sizes.empty())
+            sizes.push_back(1000000);
+        benchBulks(sizes);
+    } else if (mode == "profile") {
+        if (sizes.empty())
+            sizes.push_back(1000000);
+        benchProfiles(sizes);
+    } else if (mode == "compact") {
+        if (sizes.empty())
+            sizes.push_back(1000000);
+        benchCompacts(sizes);
+    } else if (mode == "complete") {
+        if (sizes.empty())
+            sizes.push_back(1000000);
+        benchComplete(sizes);
+    } else if (mode == "visible") {
+        if (sizes.empty())
+            sizes.push_back(1000000);
+        benchVisible(sizes);
+    } else {
+        cout << "Unknown benchmark: " + mode << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+// Load generator for server.cpp: `clients` threads each send the script
+// `requests` times over fresh connections. The first response goes to
+// stdout, so a single request doubles as a check against main.cpp; the
+// latency distribution goes to stderr.
+//   g++ -O2 -o client client.cpp
+//   ./client <socket> <script> [clients] [requests]
+
+// One round trip; false if the server cannot be reached
+bool request(const string &path, const string &script, string &response) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t sent = 0;
+    while (sent < script.size()) {
+        ssize_t n = send(fd, script.data() + sent, script.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    response.clear();
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        response.append(buf, n);
+    close(fd);
+    return sent == script.size();
+}
+
+double percentile(vector<double> &v, double p) {
+    unsigned int i = (unsigned int)(p * (v.size() - 1));
+    nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        cout << "usage: client <socket> <script> [clients] [requests]"
+             << endl;
+        return 1;
+    }
+    string path = argv[1];
+    ifstream file(argv[2]);
+    stringstream script;
+    script << file.rdbuf();
+    int clients = argc > 3 ? atoi(argv[3]) : 1;
+    int requests = argc > 4 ? atoi(argv[4]) : 1;
+
+    vector<vector<double> > latency(clients);
+    vector<int> failures(clients, 0);
+    string first;
+    vector<thread> threads;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int c = 0; c < clients; c++)
+        threads.push_back(thread([&, c]() {
+            string response;
+            for (int i = 0; i < requests; i++) {
+                chrono::steady_clock::time_point t =
+                    chrono::steady_clock::now();
+                if (!request(path, script.str(), response)) {
+                    failures[c]++;
+                    continue;
+                }
+                latency[c].push_back(chrono::duration<double>(
+                                         chrono::steady_clock::now() - t)
+                                         .count());
+                if (c == 0 && i == 0)
+                    first = response;
+            }
+        }));
+    for (int c = 0; c < clients; c++)
+        threads[c].join();
+    double elapsed =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<double> all;
+    int failed = 0;
+    for (int c = 0; c < clients; c++) {
+        all.insert(all.end(), latency[c].begin(), latency[c].end());
+        failed += failures[c];
+    }
+    cout << first;
+    if (all.empty()) {
+        cerr << "no response from " + path << endl;
+        return 1;
+    }
+    cerr << all.size() << " requests, " << failed << " failed, "
+         << all.size() / elapsed << " per s, p50 "
+         << percentile(all, 0.5) * 1e6 << " us, p99 "
+         << percentile(all, 0.99) * 1e6 << " us, max "
+         << *max_element(all.begin(), all.end()) * 1e6 << " us" << endl;
+    return 0;
+}
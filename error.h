@@ -76,6 +76,21 @@ public:
         return mess.c_str();
     }
 };
+// REMOVE of a static symbol shared with other sessions through a registry
+class SharedSymbol : public exception
+{
+    string mess;
+
+public:
+    SharedSymbol(string instruction)
+    {
+        mess = "SharedSymbol: " + instruction;
+    }
+    const char *what() const throw()
+    {
+        return mess.c_str();
+    }
+};
 class UnclosedBlock : public exception
 {
     string mess;
@@ -1,17 +1,242 @@
 #include "SymbolTable.cpp"
 #include "SymbolTable.h"
+#include <filesystem>
+#include <random>
+#include <sstream>
+#include <sys/file.h>
 using namespace std;
 
-void test(string filename) {
-    SymbolTable *st = new SymbolTable();
+// Identifies the checker in result cache keys. Defaults to the time of the
+// compile, so a rebuild never replays what an older build printed; builds
+// that want entries to survive may pass -DBUILD_ID=\"$(git rev-parse HEAD)\"
+#ifndef BUILD_ID
+#define BUILD_ID __DATE__ " " __TIME__
+#endif
+
+// The scripts of `sessions` run first, each on a table of its own, and
+// share their static symbols with the script's table through a registry;
+// their output, errors included, comes first too
+template <class Index>
+void test(istream &in, ostream &out, const Options &opts, bool stats,
+          const vector<string> &sessions) {
+    GlobalRegistry registry;
+    GlobalRegistry *globals = sessions.empty() ? nullptr : &registry;
+    for (unsigned int i = 0; i < sessions.size(); i++) {
+        BasicSymbolTable<Index> other(opts, globals);
+        istringstream script(sessions[i]);
+        try {
+            other.run(script, out);
+        } catch (exception &e) {
+            out << e.what() << endl;
+        }
+    }
+
+    BasicSymbolTable<Index> *st = new BasicSymbolTable<Index>(opts, globals);
     try {
-        st->run(filename);
+        st->run(in, out);
     } catch (exception &e) {
-        cout << e.what();
+        out << e.what();
     }
+    if (stats)
+        st->printStats(cerr);
     delete st;
 }
 
+// False if there is no such engine
+bool test(string engine, istream &in, ostream &out, const Options &opts,
+          bool stats, const vector<string> &sessions) {
+    if (engine == "splay")
+        test<SplayTree>(in, out, opts, stats, sessions);
+    else if (engine == "name")
+        test<NameSplayTree>(in, out, opts, stats, sessions);
+    else if (engine == "avl")
+        test<AVLTree>(in, out, opts, stats, sessions);
+    else if (engine == "hash")
+        test<HashIndex>(in, out, opts, stats, sessions);
+    else if (engine == "bplus")
+        test<BPlusTree>(in, out, opts, stats, sessions);
+    else
+        return false;
+    return true;
+}
+
+// Whole file in one read, false if it cannot be opened
+bool readFile(const string &filename, string &text) {
+    ifstream file(filename, ios::binary | ios::ate);
+    if (!file)
+        return false;
+    text.resize(file.tellg());
+    file.seekg(0);
+    file.read(&text[0], text.size());
+    return true;
+}
+
+string readFile(const string &filename) {
+    string text;
+    readFile(filename, text);
+    return text;
+}
+
+// xxHash64 over 8-byte words, one lane
+unsigned long long hashBytes(const string &s, unsigned long long seed) {
+    const unsigned long long P1 = 0x9E3779B185EBCA87ULL;
+    const unsigned long long P2 = 0xC2B2AE3D27D4EB4FULL;
+    const unsigned long long P4 = 0x85EBCA77C2B2AE63ULL;
+    const unsigned long long P5 = 0x27D4EB2F165667C5ULL;
+    unsigned long long h = seed + P5 + s.size();
+    size_t i = 0;
+    for (; i + 8 <= s.size(); i += 8) {
+        unsigned long long w;
+        memcpy(&w, s.data() + i, 8);
+        w *= P2;
+        w = (w << 31 | w >> 33) * P1;
+        h ^= w;
+        h = (h << 27 | h >> 37) * P1 + P4;
+    }
+    for (; i < s.size(); i++) {
+        h ^= (unsigned char)s[i] * P5;
+        h = (h << 11 | h >> 53) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= 0x165667B19E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+// Everything in the options that changes what a run prints. Without
+// counters the resolution cache, the memo and speculation all change the
+// tree shape and so PRINT. Left out, as they only decide how fast a run
+// goes: filter_bits, lookahead, threads, compact, store and profile_out; a
+// new field must be added to one side or the other. A profile counts by its
+// contents.
+string outputConfig(const Options &opts) {
+    ostringstream res;
+    res << opts.counters << ' ' << opts.splay_mode << ' ' << opts.splay_depth
+        << ' ' << opts.splay_probability << ' ' << opts.rebalance_depth << ' '
+        << opts.cache_bits << ' ' << opts.speculate << ' ' << opts.memo;
+    if (!opts.profile_in.empty())
+        res << ' ' << readFile(opts.profile_in);
+    return res.str();
+}
+
+// On-disk cache of whole runs, one file per distinct script holding exactly
+// what main printed for it. Entries are named by a 128-bit hash of the
+// script and of everything else that decides the output: the build and the
+// engine and options chosen. Reading an entry refreshes its modification
+// time, and the least recently used entries are removed once the directory
+// outgrows its budget. Entries are written to a temporary file and renamed,
+// so concurrent runs sharing a directory never read half an entry; the
+// stats file is updated under an exclusive lock.
+class ResultCache {
+  private:
+    filesystem::path dir;
+    unsigned long long budget;
+    long long hits, misses, evictions;
+
+    filesystem::path temporary(const filesystem::path &p) const {
+        return p.string() + "." + to_string(random_device()()) + ".tmp";
+    }
+
+    void write(const filesystem::path &p, const string &text) const {
+        filesystem::path tmp = temporary(p);
+        ofstream file(tmp, ios::binary);
+        file << text;
+        file.close();
+        error_code ec;
+        if (file)
+            filesystem::rename(tmp, p, ec);
+        else
+            filesystem::remove(tmp, ec);
+    }
+
+    // Oldest entries go first until the rest fit in the budget
+    void evict() {
+        vector<pair<filesystem::file_time_type, filesystem::path> > entries;
+        unsigned long long total = 0;
+        error_code ec;
+        for (filesystem::directory_iterator it(dir, ec), end; !ec && it != end;
+             it.increment(ec)) {
+            if (it->path().filename().string().size() != 32 ||
+                !it->is_regular_file(ec))
+                continue;
+            total += it->file_size(ec);
+            entries.push_back(make_pair(it->last_write_time(ec), it->path()));
+        }
+        sort(entries.begin(), entries.end());
+        for (unsigned int i = 0; i < entries.size() && total > budget; i++) {
+            total -= filesystem::file_size(entries[i].second, ec);
+            if (filesystem::remove(entries[i].second, ec))
+                this->evictions++;
+        }
+    }
+
+  public:
+    ResultCache(string dir, unsigned long long budget) {
+        this->dir = dir;
+        this->budget = budget;
+        this->hits = this->misses = this->evictions = 0;
+        error_code ec;
+        filesystem::create_directories(this->dir, ec);
+    }
+
+    static string key(const string &script, const string &version) {
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx",
+                 hashBytes(version, hashBytes(script, 0)),
+                 hashBytes(version, hashBytes(script, 1)));
+        return buf;
+    }
+
+    bool get(const string &key, string &text) {
+        filesystem::path p = dir / key;
+        if (!readFile(p, text)) {
+            this->misses++;
+            return false;
+        }
+        error_code ec;
+        filesystem::last_write_time(
+            p, filesystem::file_time_type::clock::now(), ec);
+        this->hits++;
+        return true;
+    }
+
+    void put(const string &key, const string &text) {
+        write(dir / key, text);
+        evict();
+    }
+
+    // Counters accumulate in the directory across runs
+    void saveStats() {
+        int fd = open((dir / "stats").c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            return;
+        flock(fd, LOCK_EX);
+        char buf[128] = {};
+        long long total[3] = {0, 0, 0};
+        if (read(fd, buf, sizeof(buf) - 1) > 0)
+            sscanf(buf, "%lld %lld %lld", &total[0], &total[1], &total[2]);
+        string text = to_string(total[0] + this->hits) + " " +
+                      to_string(total[1] + this->misses) + " " +
+                      to_string(total[2] + this->evictions) + "\n";
+        if (ftruncate(fd, 0) == 0 &&
+            pwrite(fd, text.data(), text.size(), 0) == (ssize_t)text.size())
+            this->hits = this->misses = this->evictions = 0;
+        close(fd); // drops the lock
+    }
+
+    void printStats(ostream &out) const {
+        long long hits = 0, misses = 0, evicted = 0;
+        ifstream in(dir / "stats");
+        in >> hits >> misses >> evicted;
+        long long runs = hits + misses;
+        out << "result cache: " << runs << " runs, " << hits << " hits ("
+            << (runs ? 100.0 * hits / runs : 0) << "%), " << evicted
+            << " evicted" << endl;
+    }
+};
+
 void validSubmittedFiles(string filename, string *allowedIncludingFiles,
                          int numOfAllowedIncludingFiles = 1) {
     ifstream infile(filename);
@@ -38,7 +263,70 @@ int main(int argc, char **argv) {
 
     string allowedCPP[] = {"SymbolTable.h"};
     validSubmittedFiles("SymbolTable.cpp", allowedCPP);
-    test(argv[1]);
 
+    string engine = "splay";
+    Options opts;
+    bool stats = false;
+    string cache_dir;
+    unsigned long long cache_budget = 64ULL << 20;
+    vector<string> sessions; // --session=FILE, in order
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--engine=") == 0)
+            engine = arg.substr(9);
+        else if (arg.find("--session=") == 0)
+            sessions.push_back(readFile(arg.substr(10)));
+        else if (arg == "--stats")
+            stats = true;
+        else if (arg.find("--result-cache=") == 0)
+            cache_dir = arg.substr(15);
+        else if (arg.find("--result-cache-size=") == 0)
+            cache_budget = atof(arg.c_str() + 20) * (1 << 20);
+        else if (!opts.set(arg)) {
+            cout << "Unknown option: " + arg << endl;
+            return 1;
+        }
+    }
+
+    if (!opts.store.empty() && !SymbolStore::open(opts.store)) {
+        cout << "Cannot open store: " + opts.store << endl;
+        return 1;
+    }
+
+    // A run that records a profile has to happen
+    if (cache_dir.empty() || !opts.profile_out.empty()) {
+        ifstream file(argv[1]);
+        if (!test(engine, file, cout, opts, stats, sessions)) {
+            cout << "Unknown engine: " + engine << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // A run is identified by the script and the sessions before it, the
+    // build of the checker and the engine and options that decide the output
+    ResultCache results(cache_dir, cache_budget);
+    string script = readFile(argv[1]);
+    string scripts = script;
+    for (unsigned int i = 0; i < sessions.size(); i++)
+        scripts += '\0' + sessions[i];
+    string version =
+        string(BUILD_ID) + '\0' + engine + '\0' + outputConfig(opts);
+    string key = ResultCache::key(scripts, version);
+    string text;
+    if (!results.get(key, text)) {
+        istringstream in(script);
+        ostringstream out;
+        if (!test(engine, in, out, opts, stats, sessions)) {
+            cout << "Unknown engine: " + engine << endl;
+            return 1;
+        }
+        text = out.str();
+        results.put(key, text);
+    }
+    cout << text;
+    results.saveStats();
+    if (stats)
+        results.printStats(cerr);
     return 0;
 }
@@ -5,6 +5,18 @@
 #include <string>
 #include <fstream>
 #include <regex>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "error.h"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,176 @@
+#include "SymbolTable.cpp"
+#include "SymbolTable.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace std;
+
+// Script server on a Unix domain socket, for checks too small to pay for a
+// process each. A client sends one script, shuts down its write side and
+// reads back exactly what main.cpp prints for that script. Connections are
+// served by a pool of workers, each reusing one table across them. A client
+// that has not sent its whole script within the timeout is dropped, so an
+// idle connection holds a worker for no longer than that.
+//   g++ -O2 -o server server.cpp
+//   ./server <socket> [--workers=N] [--timeout=SECONDS] [--engine=...]
+//            [main.cpp options]
+// See client.cpp for a load generator.
+
+// Accepted connections waiting for a worker
+class Backlog {
+  private:
+    deque<int> fds;
+    mutex lock;
+    condition_variable ready;
+
+  public:
+    void push(int fd) {
+        {
+            lock_guard<mutex> guard(lock);
+            fds.push_back(fd);
+        }
+        ready.notify_one();
+    }
+
+    int pop() {
+        unique_lock<mutex> guard(lock);
+        ready.wait(guard, [this]() { return !fds.empty(); });
+        int fd = fds.front();
+        fds.pop_front();
+        return fd;
+    }
+};
+
+// Reads the script up to EOF; false if the peer failed or went quiet and
+// the deadline passed first
+bool receive(int fd, int timeout, string &res) {
+    chrono::steady_clock::time_point deadline =
+        chrono::steady_clock::now() + chrono::seconds(timeout);
+    char buf[1 << 16];
+    while (true) {
+        long left = chrono::duration_cast<chrono::milliseconds>(
+                        deadline - chrono::steady_clock::now())
+                        .count();
+        pollfd p = {fd, POLLIN, 0};
+        if (left <= 0 || poll(&p, 1, left) <= 0)
+            return false;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == 0)
+            return true;
+        if (n < 0)
+            return false;
+        res.append(buf, n);
+    }
+}
+
+void reply(int fd, const string &text) {
+    size_t sent = 0;
+    while (sent < text.size()) {
+        ssize_t n = send(fd, text.data() + sent, text.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        sent += n;
+    }
+}
+
+template <class Index>
+void work(Backlog *backlog, const Options &opts, int timeout) {
+    BasicSymbolTable<Index> st(opts);
+    while (true) {
+        int fd = backlog->pop();
+        string script;
+        if (!receive(fd, timeout, script)) {
+            close(fd);
+            continue;
+        }
+        istringstream in(script);
+        ostringstream out;
+        try {
+            st.run(in, out);
+        } catch (exception &e) {
+            out << e.what();
+        }
+        st.reset();
+        reply(fd, out.str());
+        close(fd);
+    }
+}
+
+template <class Index>
+int serve(string path, const Options &opts, int workers, int timeout) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 128) < 0) {
+        cout << "Cannot listen on " + path << endl;
+        return 1;
+    }
+
+    Backlog backlog;
+    vector<thread> pool;
+    for (int i = 0; i < workers; i++)
+        pool.push_back(thread(work<Index>, &backlog, opts, timeout));
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0)
+            backlog.push(fd);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cout << "usage: server <socket> [--workers=N] [--timeout=SECONDS] "
+                "[options]"
+             << endl;
+        return 1;
+    }
+
+    string engine = "splay";
+    Options opts;
+    int workers = thread::hardware_concurrency();
+    int timeout = 10;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.find("--engine=") == 0)
+            engine = arg.substr(9);
+        else if (arg.find("--workers=") == 0)
+            workers = atoi(arg.c_str() + 10);
+        else if (arg.find("--timeout=") == 0)
+            timeout = atoi(arg.c_str() + 10);
+        else if (!opts.set(arg)) {
+            cout << "Unknown option: " + arg << endl;
+            return 1;
+        }
+    }
+    if (!opts.store.empty() && !SymbolStore::open(opts.store)) {
+        cout << "Cannot open store: " + opts.store << endl;
+        return 1;
+    }
+    if (workers < 1)
+        workers = 1;
+    if (timeout < 1)
+        timeout = 1;
+
+    if (engine == "splay")
+        return serve<SplayTree>(argv[1], opts, workers, timeout);
+    if (engine == "name")
+        return serve<NameSplayTree>(argv[1], opts, workers, timeout);
+    if (engine == "avl")
+        return serve<AVLTree>(argv[1], opts, workers, timeout);
+    if (engine == "hash")
+        return serve<HashIndex>(argv[1], opts, workers, timeout);
+    if (engine == "bplus")
+        return serve<BPlusTree>(argv[1], opts, workers, timeout);
+    cout << "Unknown engine: " + engine << endl;
+    return 1;
+}